@@ -56,6 +56,193 @@ May it serve you as well as it did me.
 
 #define STACK_TRACE_DEPTH 10
 
+// Per thread allocated/freed byte counters, queryable through MemLeakTracker.h.
+// These work without leak tracking too, in which case new/delete are only
+// overridden to update the counters.
+#define ENABLE_ALLOCATION_COUNTERS_IN_DEBUG   0
+#define ENABLE_ALLOCATION_COUNTERS_IN_RELEASE 0
+
+// Heap canaries: guard bytes are placed before and after each block, checked
+// on free and incrementally by a low priority background thread
+#define ENABLE_HEAP_CANARIES               0
+#define HEAP_CANARY_SIZE                   16
+#define HEAP_CANARY_BLOCKS_PER_TICK        256
+#define HEAP_CANARY_TICK_MS                10
+
+// Sampled guarded allocations: about one in GUARDED_SAMPLE_RATE allocations of
+// up to a page is placed next to a guard page so overflows and use after free
+// fault immediately. Cheap enough to leave enabled in production builds.
+#define ENABLE_GUARDED_SAMPLING            0
+#define GUARDED_SAMPLE_RATE                1000
+#define GUARDED_SLOT_COUNT                 256
+
+// Pointer table sizing: presizing the table for the expected peak allocation
+// count (a power of two) avoids resizes entirely. When the table does grow,
+// this many groups of 16 entries are migrated to the new storage per insert
+// or erase.
+#define POINTER_TABLE_INITIAL_CAPACITY     4096
+#define POINTER_TABLE_MIGRATION_GROUPS     2
+
+// Per thread allocation tables: each thread tracks its allocations in a table
+// of its own without taking a lock, frees issued by other threads are queued
+// to the owning thread. Tables of exited threads are adopted by new threads.
+// Double frees can't be detected in this mode.
+#define ENABLE_PER_THREAD_TABLES           0
+
+// Compact tracker entries: 12 bytes per tracked allocation instead of a full
+// pointer, size and stack. Addresses are packed to 48 bits, sizes above 32 KB
+// are rounded down by at most 0.2%, and stacks are interned in a depot that
+// stores each unique stack once, as 32 bit offsets into the modules its
+// frames belong to.
+#define ENABLE_COMPACT_ENTRIES             0
+
+// Event rings: when the program is started by the analyzer (this file built as
+// a console program with MEMLEAKTRACKER_ANALYZER defined), each thread writes
+// its allocation events into a shared memory ring of its own and the analyzer
+// process keeps the table and reports the leaks. Started on its own, the
+// program tracks in-process as usual. Canary checks on free are skipped while
+// the analyzer is connected.
+#define ENABLE_EVENT_RINGS                 0
+#define EVENT_RING_COUNT                   64
+#define EVENT_RING_CAPACITY                4096
+
+// Event trace: every tracked allocation and free is recorded to
+// EVENT_TRACE_FILE in per thread blocks, delta and varint encoded to a few
+// bytes per event. Timestamps are rdtsc shifted right by EVENT_TRACE_TIME_SHIFT.
+#define ENABLE_EVENT_TRACE                 0
+#define EVENT_TRACE_FILE                   "MemLeakTracker.trace"
+#define EVENT_TRACE_BLOCK_SIZE             65536
+#define EVENT_TRACE_TIME_SHIFT             10
+
+// Heap state checkpoints the analyzer stores in a trace's index, one per this
+// many events. Queries replay from the closest checkpoint before their time.
+#define TRACE_CHECKPOINT_INTERVAL          1000000
+
+// Address space heatmap: a background thread snapshots the live allocations
+// every HEATMAP_SNAPSHOT_MS and HEATMAP_FILE is written on exit, a binary PPM
+// image with a row per snapshot. Snapshots walk the allocation tables
+// HEATMAP_SLOTS_PER_STEP slots at a time, allocations wait for one step at
+// most. The address ranges that ever held allocations are laid side by side,
+// each HEATMAP_REGION_SIZE bytes wide range as HEATMAP_REGION_COLUMNS pixels.
+// Pixel brightness is how much of its range is allocated, the hue is the call
+// site that allocated most of it. The sites covering the most pixels are
+// listed with their colors on exit.
+#define ENABLE_HEATMAP                     0
+#define HEATMAP_FILE                       "MemLeakTracker.ppm"
+#define HEATMAP_SNAPSHOT_MS                100
+#define HEATMAP_SLOTS_PER_STEP             65536
+#define HEATMAP_MAX_SNAPSHOTS              4096
+#define HEATMAP_REGION_SIZE                ( 1 << 20 )
+#define HEATMAP_REGION_COLUMNS             16
+#define HEATMAP_LEGEND_SITES               8
+
+// Per module attribution: live memory is attributed to the first module in
+// each allocation's stack outside of the Windows directory, so allocations
+// made by system DLLs on behalf of a plugin count towards the plugin. Leaks
+// are summed per module on exit and LeakTracker::DumpLiveBytesPerModule()
+// reports the live bytes at any time. The module is resolved when a block is
+// allocated, looked up once per unique return address, so blocks of modules
+// unloaded before the report keep their module. Requires stack traces.
+#define ENABLE_MODULE_ATTRIBUTION          0
+
+// Missing reserve detector: a thread allocating a block and then freeing one
+// allocated at the same call site that's 1.4 to 2.1 times smaller is counted
+// as a container reallocation, the signature of std::vector or std::string
+// growing without reserve(). Sites with at least RESERVE_MIN_REALLOCATIONS are
+// listed on exit and by LeakTracker::DumpMissingReserves() with the bytes
+// copied by the reallocations.
+#define ENABLE_RESERVE_DETECTOR            0
+#define RESERVE_MIN_REALLOCATIONS          4
+#define RESERVE_REPORT_SITES               32
+
+// Content analysis: LeakTracker::DumpDuplicateBlocks() hashes the contents of
+// every live block on CONTENT_ANALYSIS_THREADS threads (0 uses one per core)
+// and lists the call sites with the most bytes in identical copies of the same
+// block or in blocks that are entirely zero. Blocks are hashed without holding
+// the tracker's lock, the ones freed meanwhile are released after the pass.
+#define ENABLE_CONTENT_ANALYSIS            0
+#define CONTENT_ANALYSIS_THREADS           0
+#define CONTENT_REPORT_SITES               32
+
+// Crash dump descriptor: an exported descriptor of the tracker's tables lets
+// the analyzer (MemLeakAnalyzer -dump <file>) report the leaks and live
+// allocations of a crashed process from its full memory minidump. Nothing is
+// done at runtime.
+#define ENABLE_DUMP_DESCRIPTOR             0
+
+// Startup phases: allocations, bytes and the cycles spent in the underlying
+// allocator are counted for static initialization (until the CRT has run the
+// module's initializers), startup (until the application calls
+// LeakTracker::MarkReady()) and steady state. MarkReady() prints the first two
+// phases, exit prints all three. The first two also list their top
+// STARTUP_REPORT_SITES call sites by allocator cycles, steady state has no per
+// site data and takes no lock. Nothing is set up before the first allocation.
+#define ENABLE_STARTUP_PHASES              0
+#define STARTUP_REPORT_SITES               16
+
+// No-allocation zones: new or delete on a thread inside a
+// LeakTracker::ScopedNoAlloc scope is a violation. NO_ALLOC_POLICY 0 only
+// counts them (LeakTracker::NoAllocViolations(), printed on exit), 1 also
+// prints the stack of each, 2 also breaks into the debugger or aborts.
+#define ENABLE_NO_ALLOC_ZONES              0
+#define NO_ALLOC_POLICY                    1
+
+// Epoch profile: LeakTracker::MarkEpoch() ends an epoch (a frame, a batch, an
+// event loop tick), every thread's allocations count towards the current one.
+// The distribution of allocations, bytes and frees per epoch is reported on
+// exit and by LeakTracker::DumpEpochProfile(), with the EPOCH_WORST_COUNT
+// epochs with the most allocations and their top EPOCH_REPORT_SITES sites.
+#define ENABLE_EPOCH_PROFILE               0
+#define EPOCH_WORST_COUNT                  8
+#define EPOCH_REPORT_SITES                 8
+
+// Coroutine frame attribution: frames of coroutines whose promise type derives
+// from LeakTracker::CoroutineFramePromise are counted per coroutine, with
+// their bytes, largest frame and peak live bytes, to find where heap elision
+// would pay off. Frames carry a small header naming their coroutine. Listed on
+// exit and by LeakTracker::DumpCoroutineFrames(), with the coroutine's name
+// when stack traces are on.
+#define ENABLE_COROUTINE_ATTRIBUTION       0
+#define COROUTINE_REPORT_SITES             32
+
+// Exception tracking: C++ throws are counted per exception type and per throw
+// site, with the bytes of the thrown objects, by a vectored exception handler.
+// MSVC builds exception objects in the throwing frame instead of allocating
+// them, so the throws are what's counted. Listed on exit and by
+// LeakTracker::DumpExceptions().
+#define ENABLE_EXCEPTION_TRACKING          0
+#define EXCEPTION_REPORT_SITES             16
+
+// Page fault sampling: every PAGE_FAULT_SAMPLE_RATEth allocation of at least
+// PAGE_FAULT_MIN_SIZE bytes on a thread has its pages looked up in the working
+// set as the allocator returns it. Pages that aren't resident yet fault on
+// first touch. The call sites with the most are listed, with the faults
+// extrapolated from the samples, on exit and by
+// LeakTracker::DumpPageFaultSites(). Only available with the release CRT, the
+// debug CRT's malloc fills new blocks with 0xCD and so faults in every page.
+#define ENABLE_PAGE_FAULT_SAMPLING         0
+#define PAGE_FAULT_SAMPLE_RATE             16
+#define PAGE_FAULT_MIN_SIZE                65536
+#define PAGE_FAULT_CHECKED_PAGES           256
+#define PAGE_FAULT_REPORT_SITES            32
+
+// Locality report: LeakTracker::DumpLocality() lists the call sites whose live
+// objects are spread over the most pages beyond what their bytes would fill,
+// with the pages and cache lines they touch per 1000 objects and the mean
+// distance between consecutive allocations of the site on a thread, to find
+// node based structures that would gain from an arena or slab.
+#define ENABLE_LOCALITY_REPORT             0
+#define LOCALITY_REPORT_SITES              32
+
+// Large pages for the tracker's big metadata regions (the pointer table) to cut
+// down on TLB misses with huge tables. Requires the SeLockMemoryPrivilege, the
+// tracker falls back to regular pages without it.
+#define ENABLE_LARGE_PAGES                 0
+
+// Per thread latency histograms of the cycles spent in the tracked new/delete,
+// split by phase. Printed on exit and by LeakTracker::DumpLatencyHistograms().
+#define ENABLE_LATENCY_HISTOGRAMS          0
+
 //////////////////////////////////////////////////////////////////////////
 // Auto config
 
@@ -66,7 +253,11 @@ May it serve you as well as it did me.
 #if ENABLE_STACK_TRACES_IN_RELEASE
 #define ENABLE_STACK_TRACE
 #endif // ENABLE_STACK_TRACES_IN_RELEASE
+#if ENABLE_ALLOCATION_COUNTERS_IN_RELEASE
+#define ENABLE_ALLOCATION_COUNTERS
+#endif // ENABLE_ALLOCATION_COUNTERS_IN_RELEASE
 #define STACK_OFFSET 1
+#define INNER_STACK_OFFSET 1 // call sites one frame shallower than STACK_OFFSET assumes
 #else
 #if ENABLE_MEMLEAK_TRACKING_IN_DEBUG
 #define ENABLE_MEMORY_LEAK_TRACKING
@@ -74,23 +265,349 @@ May it serve you as well as it did me.
 #if ENABLE_STACK_TRACES_IN_DEBUG
 #define ENABLE_STACK_TRACE
 #endif // ENABLE_STACK_TRACES_IN_DEBUG
-#define STACK_OFFSET 4
+#if ENABLE_ALLOCATION_COUNTERS_IN_DEBUG
+#define ENABLE_ALLOCATION_COUNTERS
+#endif // ENABLE_ALLOCATION_COUNTERS_IN_DEBUG
+#define STACK_OFFSET 5
+#define INNER_STACK_OFFSET 4 // call sites one frame shallower than STACK_OFFSET assumes
+#endif // _DEBUG
+
+// The analyzer process doesn't track itself
+#ifdef MEMLEAKTRACKER_ANALYZER
+#undef ENABLE_MEMORY_LEAK_TRACKING
+#undef ENABLE_ALLOCATION_COUNTERS
+#endif // MEMLEAKTRACKER_ANALYZER
+
+#if defined( ENABLE_MEMORY_LEAK_TRACKING ) || defined( ENABLE_ALLOCATION_COUNTERS )
+#define OVERRIDE_NEW_DELETE
+#endif
+
+// The diagnostics below are all part of the leak tracker
+#ifndef ENABLE_MEMORY_LEAK_TRACKING
+#undef ENABLE_HEAP_CANARIES
+#define ENABLE_HEAP_CANARIES 0
+#undef ENABLE_GUARDED_SAMPLING
+#define ENABLE_GUARDED_SAMPLING 0
+#undef ENABLE_LATENCY_HISTOGRAMS
+#define ENABLE_LATENCY_HISTOGRAMS 0
+#undef ENABLE_PER_THREAD_TABLES
+#define ENABLE_PER_THREAD_TABLES 0
+#undef ENABLE_COMPACT_ENTRIES
+#define ENABLE_COMPACT_ENTRIES 0
+#undef ENABLE_EVENT_RINGS
+#define ENABLE_EVENT_RINGS 0
+#undef ENABLE_EVENT_TRACE
+#define ENABLE_EVENT_TRACE 0
+#undef ENABLE_HEATMAP
+#define ENABLE_HEATMAP 0
+#undef ENABLE_RESERVE_DETECTOR
+#define ENABLE_RESERVE_DETECTOR 0
+#undef ENABLE_CONTENT_ANALYSIS
+#define ENABLE_CONTENT_ANALYSIS 0
+#undef ENABLE_DUMP_DESCRIPTOR
+#define ENABLE_DUMP_DESCRIPTOR 0
+#undef ENABLE_STARTUP_PHASES
+#define ENABLE_STARTUP_PHASES 0
+#undef ENABLE_NO_ALLOC_ZONES
+#define ENABLE_NO_ALLOC_ZONES 0
+#undef ENABLE_EPOCH_PROFILE
+#define ENABLE_EPOCH_PROFILE 0
+#undef ENABLE_COROUTINE_ATTRIBUTION
+#define ENABLE_COROUTINE_ATTRIBUTION 0
+#undef ENABLE_EXCEPTION_TRACKING
+#define ENABLE_EXCEPTION_TRACKING 0
+#undef ENABLE_PAGE_FAULT_SAMPLING
+#define ENABLE_PAGE_FAULT_SAMPLING 0
+#undef ENABLE_LOCALITY_REPORT
+#define ENABLE_LOCALITY_REPORT 0
+#endif // ENABLE_MEMORY_LEAK_TRACKING
+
+// The debug CRT touches every page of a new block before the tracker sees it
+#ifdef _DEBUG
+#undef ENABLE_PAGE_FAULT_SAMPLING
+#define ENABLE_PAGE_FAULT_SAMPLING 0
 #endif // _DEBUG
 
+#if !defined( ENABLE_MEMORY_LEAK_TRACKING ) || !defined( ENABLE_STACK_TRACE )
+#undef ENABLE_MODULE_ATTRIBUTION
+#define ENABLE_MODULE_ATTRIBUTION 0
+#endif // ENABLE_MEMORY_LEAK_TRACKING && ENABLE_STACK_TRACE
+
+//////////////////////////////////////////////////////////////////////////
+// Formats shared with the analyzer process
+
+#if ENABLE_EVENT_RINGS || ENABLE_EVENT_TRACE || ENABLE_COMPACT_ENTRIES || ENABLE_DUMP_DESCRIPTOR || defined( MEMLEAKTRACKER_ANALYZER )
+
+#include <stdint.h>
+#include <atomic>
+#include <Windows.h>
+#include <tchar.h>
+#include <intrin.h>
+
+namespace LeakTracker
+{
+
+static const uint32_t eventSectionMagic = 0x52544c4d;
+static const uint32_t eventSectionVersion = 1;
+
+enum class EventType : uint32_t
+{
+  Allocate,
+  Free,
+};
+
+enum class SessionState : uint32_t
+{
+  Running,
+  Exiting,  // set by the tracked process on exit, it waits for the report
+  Reported,
+};
+
+struct TrackerEvent
+{
+  uint64_t timestamp; // rdtsc, the analyzer merges the rings in this order
+  uint64_t address;
+  uint64_t size;
+  EventType type;
+  uint32_t frameCount;
+  uint64_t frames[ STACK_TRACE_DEPTH ];
+};
+
+// Single producer (the thread owning the ring), single consumer (the analyzer)
+struct EventRing
+{
+  alignas( 64 ) std::atomic<uint64_t> writeIndex;
+  alignas( 64 ) std::atomic<uint64_t> readIndex;
+  TrackerEvent events[ EVENT_RING_CAPACITY ];
+};
+
+// Created by the analyzer before the tracked process starts
+struct EventSection
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ringCount;
+  uint32_t ringCapacity;
+  uint32_t stackDepth;
+  DWORD analyzerProcessId;
+  std::atomic<SessionState> state;
+  std::atomic<uint32_t> ringsInUse;
+  std::atomic<uint64_t> droppedEvents;
+  EventRing rings[ EVENT_RING_COUNT ];
+};
+
+void GetEventSectionName( TCHAR( &name )[ 64 ], DWORD processId )
+{
+  _sntprintf_s( name, 63, _T( "Local\\MemLeakTracker.%lu\0" ), processId );
+}
+
+// Event trace files are a TraceFileHeader followed by blocks, each a
+// TraceBlockHeader and byteCount bytes of events of a single thread.
+// Events are a series of LEB128 varints:
+//   head:    time delta to the previous event of the block << 2 | TraceEventKind
+//   address: address xor the previous address of the block, rotated right by 4
+// allocations continue with
+//   size:    ( class size - size ) << 7 | size class, see GetTraceSizeClass()
+//   stack:   TraceEventKind::Allocate refers to a slot of the block's stack
+//            table, AllocateNewStack is followed by the frame count and the
+//            frames, each xor the previous one, and is stored in the slot
+//            TraceStackHash() % traceStackSlots
+// Blocks are self contained: the time, address and stack table start over
+// with each block.
+static const uint32_t traceFileMagic = 0x4654544d;
+static const uint32_t traceBlockMagic = 0x4254544d;
+static const uint32_t traceVersion = 1;
+static const uint32_t traceStackSlots = 128;
+
+enum TraceEventKind : uint32_t
+{
+  Free,
+  Allocate,
+  AllocateNewStack,
+};
+
+struct TraceFileHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t timeShift;
+  uint32_t stackDepth;
+  uint64_t ticksPerSecond; // of the shifted timestamps, filled in on exit
+};
+
+struct TraceBlockHeader
+{
+  uint32_t magic;
+  uint32_t threadId;
+  uint64_t baseTime;
+  uint32_t byteCount;
+  uint32_t eventCount;
+};
+
+// Size classes: 16 byte steps up to 128 bytes, then two per power of two
+uint32_t GetTraceSizeClass( uint64_t size, uint64_t& classSize )
+{
+  if ( size <= 128 )
+  {
+    uint32_t sizeClass = size ? (uint32_t)( size - 1 ) / 16 : 0;
+    classSize = ( sizeClass + 1 ) * 16;
+    return sizeClass;
+  }
+
+  unsigned long bit;
+#ifdef _WIN64
+  _BitScanReverse64( &bit, size - 1 );
+#else
+  if ( _BitScanReverse( &bit, (unsigned long)( ( size - 1 ) >> 32 ) ) )
+    bit += 32;
+  else
+    _BitScanReverse( &bit, (unsigned long)( size - 1 ) );
+#endif // _WIN64
+  uint64_t half = 1ull << bit;
+  bool upper = size > half + half / 2;
+  classSize = upper ? half * 2 : half + half / 2;
+  return 8 + ( bit - 7 ) * 2 + upper;
+}
+
+uint64_t GetTraceClassSize( uint32_t sizeClass )
+{
+  if ( sizeClass < 8 )
+    return ( sizeClass + 1 ) * 16;
+  uint64_t half = 1ull << ( 7 + ( sizeClass - 8 ) / 2 );
+  return ( sizeClass - 8 ) % 2 ? half * 2 : half + half / 2;
+}
+
+// Never 0, which marks an unused stack slot
+uint64_t TraceStackHash( const uint64_t* frames, uint32_t frameCount )
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for ( uint32_t x = 0; x < frameCount; x++ )
+    hash = ( hash ^ frames[ x ] ) * 0x100000001b3ull;
+  return hash | 1;
+}
+
+// Compact entry sizes: below 32 KB they are stored as is, larger ones as a
+// 6 bit exponent and the 9 bits below the leading one
+uint16_t EncodeSize( size_t size )
+{
+  if ( size < 0x8000 )
+    return (uint16_t)size;
+
+  unsigned long exponent;
+#ifdef _WIN64
+  _BitScanReverse64( &exponent, size );
+#else
+  _BitScanReverse( &exponent, (unsigned long)size );
+#endif // _WIN64
+  return (uint16_t)( 0x8000 | ( ( exponent - 15 ) << 9 ) | ( ( size >> ( exponent - 9 ) ) & 0x1ff ) );
+}
+
+size_t DecodeSize( uint16_t code )
+{
+  if ( !( code & 0x8000 ) )
+    return code;
+
+  size_t exponent = ( ( code >> 9 ) & 0x3f ) + 15;
+  return (size_t)( 0x200 | ( code & 0x1ff ) ) << ( exponent - 9 );
+}
+
+static const uint64_t dumpDescriptorMagic[ 2 ] = { 0x72656b636172544dull, 0x7470697263736544ull };
+static const uint32_t dumpDescriptorVersion = 2;
+
+enum DumpLayoutFlags : uint32_t
+{
+  dumpPerThreadTables = 1,
+  dumpCompactEntries = 2,
+  dumpStackTraces = 4,
+};
+
+// Where the allocation tables are and how they are laid out in memory. The
+// analyzer finds the descriptor in a crash dump by its magic and the address
+// it holds of itself, which copies of the magic don't match.
+struct DumpDescriptor
+{
+  uint64_t magic[ 2 ];
+  uint64_t self;
+  uint32_t version;
+  uint32_t pointerSize;
+  uint32_t flags;
+  uint32_t stackDepth;
+
+  // the table, or the thread records in per thread mode
+  uint64_t table;
+  uint64_t threadRecords; // address of the first record pointer
+  uint32_t recordNextOffset;
+  uint32_t recordTableOffset; // OwnedTable pointer in a record
+  uint32_t ownedTableOffset; // table in an OwnedTable
+
+  // PointerTable storages
+  uint32_t storageOffsets[ 2 ];
+  uint32_t controlOffset;
+  uint32_t entriesOffset;
+  uint32_t capacityOffset;
+
+  // entries: a pointer or a 48 bit address, a size_t or a 16 bit size code,
+  // and stackDepth frames or a stack depot id
+  uint32_t entrySize;
+  uint32_t keyOffset;
+  uint32_t sizeOffset;
+  uint32_t stackOffset;
+
+  // stack depot of compact entries
+  uint64_t stackDepot;
+  uint32_t depotModulesOffset;
+  uint32_t depotModuleSize;
+  uint32_t depotChunksOffset;
+  uint32_t depotChunkSize;
+  uint32_t depotStackSize;
+  uint32_t depotStackModulesOffset;
+  uint32_t depotStackOffsetsOffset;
+  uint32_t depotStacksPerChunk;
+};
+
+}
+
+#endif // ENABLE_EVENT_RINGS || ENABLE_EVENT_TRACE || ENABLE_COMPACT_ENTRIES || ENABLE_DUMP_DESCRIPTOR || MEMLEAKTRACKER_ANALYZER
+
 //////////////////////////////////////////////////////////////////////////
 // Implementation
 
-#ifdef ENABLE_MEMORY_LEAK_TRACKING
+#ifdef OVERRIDE_NEW_DELETE
 
-#include <unordered_map>
+#include <stdint.h>
+#include <new>
+#include <utility>
+#include <atomic>
 #include <Windows.h>
 #include <tchar.h>
+#include <intrin.h>
+
+#if defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define POINTER_TABLE_SSE2
+#endif
 
 #ifdef ENABLE_STACK_TRACE
 #include <DbgHelp.h>
 #pragma comment(lib,"dbghelp.lib")
 #endif // ENABLE_STACK_TRACE
 
+#if ENABLE_HEATMAP
+#include <stdio.h>
+#endif // ENABLE_HEATMAP
+
+#if ENABLE_PAGE_FAULT_SAMPLING
+#include <Psapi.h>
+#pragma comment(lib,"psapi.lib")
+#endif // ENABLE_PAGE_FAULT_SAMPLING
+
+#if ENABLE_LOCALITY_REPORT
+#include <math.h>
+#endif // ENABLE_LOCALITY_REPORT
+
+#if ENABLE_HEATMAP || ENABLE_MODULE_ATTRIBUTION || ENABLE_RESERVE_DETECTOR || ENABLE_CONTENT_ANALYSIS || ENABLE_STARTUP_PHASES || ENABLE_EPOCH_PROFILE || ENABLE_COROUTINE_ATTRIBUTION || ENABLE_EXCEPTION_TRACKING || ENABLE_PAGE_FAULT_SAMPLING || ENABLE_LOCALITY_REPORT
+#include <algorithm>
+#endif // ENABLE_HEATMAP || ENABLE_MODULE_ATTRIBUTION || ENABLE_RESERVE_DETECTOR || ENABLE_CONTENT_ANALYSIS || ENABLE_STARTUP_PHASES || ENABLE_EPOCH_PROFILE || ENABLE_COROUTINE_ATTRIBUTION || ENABLE_EXCEPTION_TRACKING || ENABLE_PAGE_FAULT_SAMPLING || ENABLE_LOCALITY_REPORT
+
 namespace LeakTracker
 {
 
@@ -111,10 +628,39 @@ class StackTracker
   }
 public:
 
-  StackTracker()
+  StackTracker( int framesToSkip = STACK_OFFSET )
   {
     memset( stack, 0, sizeof( stack ) );
-    RtlCaptureStackBackTrace( STACK_OFFSET, STACK_TRACE_DEPTH, stack, NULL );
+    RtlCaptureStackBackTrace( framesToSkip, STACK_TRACE_DEPTH, stack, NULL );
+  }
+
+  StackTracker( void* const* frames )
+  {
+    memcpy( stack, frames, sizeof( stack ) );
+  }
+
+  void* const* GetFrames() const
+  {
+    return stack;
+  }
+
+  // Returns false if the frame has no symbol
+  bool GetFunctionName( int frame, char* name, size_t length )
+  {
+    if ( !stack[ frame ] )
+      return false;
+
+    InitializeSym();
+    char buffer[ sizeof( SYMBOL_INFO ) + MAX_SYM_NAME ];
+    SYMBOL_INFO* symbol = (SYMBOL_INFO*)buffer;
+    symbol->SizeOfStruct = sizeof( SYMBOL_INFO );
+    symbol->MaxNameLen = MAX_SYM_NAME;
+    DWORD64 displacement;
+    if ( !SymFromAddr( GetCurrentProcess(), (DWORD64)stack[ frame ], &displacement, symbol ) )
+      return false;
+
+    strncpy_s( name, length, symbol->Name, _TRUNCATE );
+    return true;
   }
 
   void DumpToDebugOutput()
@@ -192,166 +738,5956 @@ public:
   }
 };
 
-class AllocationInfo
+#if ENABLE_LATENCY_HISTOGRAMS
+enum class LatencyPhase
+{
+  New,
+  Delete,
+  StackCapture,
+  LockWait,
+  TableUpdate,
+  Count
+};
+
+// Log-linear histogram of cycle counts with 32 sub-buckets per power of two,
+// giving about 3% precision over the whole 64 bit range
+class LatencyHistogram
 {
 public:
-  size_t size;
+  static const int subBucketBits = 5;
+  static const int subBucketCount = 1 << subBucketBits;
+  static const int bucketCount = ( 64 - subBucketBits + 1 ) * subBucketCount;
 
-#ifdef ENABLE_STACK_TRACE
-  StackTracker stack;
-#endif // ENABLE_STACK_TRACE
+  unsigned int counts[ bucketCount ];
+  unsigned long long maxValue;
 
-  AllocationInfo( size_t size )
-    : size( size )
+  static int HighestBit( unsigned long long value )
   {
+    unsigned long index;
+#ifdef _WIN64
+    _BitScanReverse64( &index, value );
+#else
+    if ( _BitScanReverse( &index, (unsigned long)( value >> 32 ) ) )
+      return index + 32;
+    _BitScanReverse( &index, (unsigned long)value );
+#endif // _WIN64
+    return index;
   }
-};
 
-class MemTracker
-{
-  Mutex critsec;
-  bool paused = true; // this needs to be above the memTrackerPool variable (init order)
-  std::unordered_map<const void*, AllocationInfo> memTrackerPool;
+  static int GetBucket( unsigned long long value )
+  {
+    if ( value < subBucketCount )
+      return (int)value;
+    int shift = HighestBit( value ) - subBucketBits;
+    return ( shift + 1 ) * subBucketCount + (int)( value >> shift ) - subBucketCount;
+  }
 
-public:
+  // The highest value that falls into the given bucket
+  static unsigned long long GetBucketValue( int bucket )
+  {
+    if ( bucket < subBucketCount )
+      return bucket;
+    int shift = bucket / subBucketCount - 1;
+    return ( ( (unsigned long long)( bucket % subBucketCount + subBucketCount + 1 ) ) << shift ) - 1;
+  }
 
-  MemTracker()
+  void Record( unsigned long long value )
   {
-    paused = false;
+    counts[ GetBucket( value ) ]++;
+    if ( value > maxValue )
+      maxValue = value;
   }
 
-  ~MemTracker()
+  void Merge( const LatencyHistogram& other )
   {
-    paused = true;
+    for ( int x = 0; x < bucketCount; x++ )
+      counts[ x ] += other.counts[ x ];
+    if ( other.maxValue > maxValue )
+      maxValue = other.maxValue;
+  }
 
-    if ( memTrackerPool.size() )
+  unsigned long long GetPercentile( unsigned long long total, double percentile ) const
+  {
+    unsigned long long target = (unsigned long long)( total * percentile / 100.0 ), seen = 0;
+    for ( int x = 0; x < bucketCount; x++ )
     {
-      //report leaks
-      OutputDebugString( _T( "\n--- Memleaks start here ---\n\n" ) );
+      seen += counts[ x ];
+      if ( seen > target )
+        return GetBucketValue( x ) < maxValue ? GetBucketValue( x ) : maxValue;
+    }
+    return maxValue;
+  }
+};
+#endif // ENABLE_LATENCY_HISTOGRAMS
 
-      size_t totalLeaked = 0;
+#if ENABLE_PER_THREAD_TABLES
+struct OwnedTable;
+struct ThreadRecord;
+void DrainExitedThread( ThreadRecord& record );
+#endif // ENABLE_PER_THREAD_TABLES
 
-      TCHAR buffer[ 1024 ];
+#if ENABLE_EVENT_TRACE
+struct TraceBuffer;
+#endif // ENABLE_EVENT_TRACE
 
-      for ( auto& entry : memTrackerPool )
-      {
-        _sntprintf_s( buffer, 1023, _T( "Leak: %zu bytes\n\0" ), entry.second.size );
-        OutputDebugString( buffer );
+#if ENABLE_EPOCH_PROFILE
+struct ThreadEpoch;
+#endif // ENABLE_EPOCH_PROFILE
 
-#ifdef ENABLE_STACK_TRACE
-        entry.second.stack.DumpToDebugOutput();
-#endif
-        totalLeaked += entry.second.size;
-      }
+#if ENABLE_LOCALITY_REPORT
+struct ThreadDistances;
+#endif // ENABLE_LOCALITY_REPORT
 
-      _sntprintf_s( buffer, 1023, _T( "\tTotal bytes leaked: %zu\n\n\0" ), totalLeaked );
-      OutputDebugString( buffer );
-    }
-    else
+#if ENABLE_STARTUP_PHASES
+enum class ProcessPhase
+{
+  StaticInitialization,
+  Startup,
+  SteadyState,
+  Count
+};
+
+// Allocator use of a thread in a process phase
+struct PhaseTotals
+{
+  std::atomic<uint64_t> allocations;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> allocationCycles;
+  std::atomic<uint64_t> frees;
+  std::atomic<uint64_t> freeCycles;
+};
+#endif // ENABLE_STARTUP_PHASES
+
+// Per thread data of the tracker. Records are never freed: when a thread exits
+// its record is handed to the next new thread, so statistics gathered by exited
+// threads stay part of the merged results.
+struct ThreadRecord
+{
+  ThreadRecord* next;
+  std::atomic<bool> inUse; // read without the registry lock by threads freeing the record's blocks
+
+#if ENABLE_LATENCY_HISTOGRAMS
+  LatencyHistogram latency[ (int)LatencyPhase::Count ];
+#endif // ENABLE_LATENCY_HISTOGRAMS
+
+#ifdef ENABLE_ALLOCATION_COUNTERS
+  // only written by the owning thread, relaxed atomics keep other threads' reads well defined
+  std::atomic<unsigned long long> allocatedBytes;
+  std::atomic<unsigned long long> freedBytes;
+#endif // ENABLE_ALLOCATION_COUNTERS
+
+#if ENABLE_PER_THREAD_TABLES
+  std::atomic<OwnedTable*> ownedTable;
+#endif // ENABLE_PER_THREAD_TABLES
+
+#if ENABLE_EVENT_RINGS
+  EventRing* eventRing;
+#endif // ENABLE_EVENT_RINGS
+
+#if ENABLE_EVENT_TRACE
+  TraceBuffer* traceBuffer;
+#endif // ENABLE_EVENT_TRACE
+
+#if ENABLE_RESERVE_DETECTOR
+  // the thread's last allocation, cleared by its next free
+  size_t lastAllocationSize;
+  uint32_t lastAllocationSite;
+#endif // ENABLE_RESERVE_DETECTOR
+
+#if ENABLE_STARTUP_PHASES
+  // only written by the owning thread
+  PhaseTotals phaseTotals[ (int)ProcessPhase::Count ];
+#endif // ENABLE_STARTUP_PHASES
+
+#if ENABLE_EPOCH_PROFILE
+  std::atomic<ThreadEpoch*> epoch;
+#endif // ENABLE_EPOCH_PROFILE
+
+#if ENABLE_LOCALITY_REPORT
+  std::atomic<ThreadDistances*> distances;
+#endif // ENABLE_LOCALITY_REPORT
+};
+
+class ThreadRegistry
+{
+  SRWLOCK lock = SRWLOCK_INIT;
+  ThreadRecord* head = nullptr;
+
+  static thread_local ThreadRecord* current;
+  static thread_local bool released; // set on thread exit, the thread gets no new record after
+
+  // Releases the thread's record on thread exit
+  struct Releaser
+  {
+    ~Releaser();
+  };
+  static thread_local Releaser releaser;
+
+#ifdef ENABLE_ALLOCATION_COUNTERS
+  // totals of exited threads, their records start from zero when reused
+  unsigned long long exitedAllocatedBytes = 0;
+  unsigned long long exitedFreedBytes = 0;
+#endif // ENABLE_ALLOCATION_COUNTERS
+
+  ThreadRecord* Acquire()
+  {
+    AcquireSRWLockExclusive( &lock );
+    ThreadRecord* record = head;
+    while ( record && record->inUse )
+      record = record->next;
+
+    if ( !record )
     {
-      OutputDebugString( _T( "**********************************************************\n\t\t\t\t\tNo memleaks found.\n**********************************************************\n\n" ) );
+      void* memory = VirtualAlloc( NULL, sizeof( ThreadRecord ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+      if ( memory )
+      {
+        record = new ( memory ) ThreadRecord();
+        record->next = head;
+        head = record;
+      }
     }
+
+    if ( record )
+      record->inUse = true;
+    ReleaseSRWLockExclusive( &lock );
+    return record;
   }
 
-  void AddPointer( void* p, size_t size )
+public:
+
+  // Returns nullptr if no memory is left for a new record, or once the
+  // thread's record was released on thread exit
+  ThreadRecord* GetCurrent()
   {
-    Lock cs( critsec );
-    if ( !paused && p )
+    if ( !current && !released )
     {
-      paused = true;
-      memTrackerPool.insert_or_assign( p, AllocationInfo( size ) );
-      paused = false;
+      current = Acquire();
+      (void)&releaser; // instantiates the thread exit hook
     }
+    return current;
   }
 
-  void RemovePointer( void* p )
+  // A record that no thread owns and that is never released
+  ThreadRecord* AcquireUnowned()
   {
-    Lock cs( critsec );
-    if ( !paused && p )
-    {
-      paused = true;
-      size_t erased = memTrackerPool.erase( p );
-      if ( !erased )
-      {
-        OutputDebugString( _T( "**** ERROR: Trying to delete non logged, possibly already freed memory block!\n" ) );
-#ifdef ENABLE_STACK_TRACE
-        StackTracker s;
-        s.DumpToDebugOutput();
-#endif // ENABLE_STACK_TRACKER
-      }
-      paused = false;
-    }
+    return Acquire();
   }
 
-  void Pause()
+  void Release()
   {
-    Lock cs( critsec );
-    paused = true;
+    released = true;
+    if ( !current )
+      return;
+
+    AcquireSRWLockExclusive( &lock );
+#ifdef ENABLE_ALLOCATION_COUNTERS
+    exitedAllocatedBytes += current->allocatedBytes.exchange( 0, std::memory_order_relaxed );
+    exitedFreedBytes += current->freedBytes.exchange( 0, std::memory_order_relaxed );
+#endif // ENABLE_ALLOCATION_COUNTERS
+    ThreadRecord* record = current;
+    current->inUse = false;
+    current = nullptr;
+    ReleaseSRWLockExclusive( &lock );
+
+#if ENABLE_PER_THREAD_TABLES
+    // frees other threads queued for the exited thread would otherwise wait until its record is reused
+    DrainExitedThread( *record );
+#else
+    (void)record;
+#endif // ENABLE_PER_THREAD_TABLES
   }
 
-  void Resume()
+  template<typename F>
+  void ForEach( F fn )
   {
-    Lock cs( critsec );
-    paused = false;
+    AcquireSRWLockShared( &lock );
+    for ( ThreadRecord* record = head; record; record = record->next )
+      fn( *record );
+    ReleaseSRWLockShared( &lock );
+  }
+
+#if ENABLE_DUMP_DESCRIPTOR && ENABLE_PER_THREAD_TABLES
+  void DescribeLayout( DumpDescriptor& descriptor );
+#endif // ENABLE_DUMP_DESCRIPTOR && ENABLE_PER_THREAD_TABLES
+
+#ifdef ENABLE_ALLOCATION_COUNTERS
+  void GetProcessBytes( unsigned long long& allocated, unsigned long long& freed )
+  {
+    AcquireSRWLockShared( &lock );
+    allocated = exitedAllocatedBytes;
+    freed = exitedFreedBytes;
+    for ( ThreadRecord* record = head; record; record = record->next )
+    {
+      allocated += record->allocatedBytes.load( std::memory_order_relaxed );
+      freed += record->freedBytes.load( std::memory_order_relaxed );
+    }
+    ReleaseSRWLockShared( &lock );
   }
+#endif // ENABLE_ALLOCATION_COUNTERS
 };
 
-//This should force the memTracker variable to be constructed before everything else:
-#pragma warning(disable:4074)
-#pragma init_seg(compiler)
-MemTracker memTracker;
-}
+ThreadRegistry threadRegistry;
+thread_local ThreadRecord* ThreadRegistry::current = nullptr;
+thread_local bool ThreadRegistry::released = false;
+thread_local ThreadRegistry::Releaser ThreadRegistry::releaser;
 
-void* __cdecl operator new( size_t size )
+ThreadRegistry::Releaser::~Releaser()
 {
-  void* p = malloc( size );
-  LeakTracker::memTracker.AddPointer( p, size );
-  return p;
+  threadRegistry.Release();
 }
 
-void* __cdecl operator new[]( size_t size )
-{
-  void* p = malloc( size );
-  LeakTracker::memTracker.AddPointer( p, size );
-  return p;
-}
+#if ENABLE_LATENCY_HISTOGRAMS
+#define LATENCY_START( name ) unsigned long long name = __rdtsc()
+#define LATENCY_RECORD( phase, name ) RecordLatency( phase, __rdtsc() - name )
 
-void* __cdecl operator new( size_t size, const char* file, int line )
+void RecordLatency( LatencyPhase phase, unsigned long long cycles )
 {
-  void* p = malloc( size );
-  LeakTracker::memTracker.AddPointer( p, size );
-  return p;
+  if ( ThreadRecord* record = threadRegistry.GetCurrent() )
+    record->latency[ (int)phase ].Record( cycles );
 }
 
-void* __cdecl operator new[]( size_t size, const char* file, int line )
+void ReportLatency()
 {
-  void* p = malloc( size );
-  LeakTracker::memTracker.AddPointer( p, size );
-  return p;
+  static const TCHAR* phaseNames[] = { _T( "new" ), _T( "delete" ), _T( "stack capture" ), _T( "lock wait" ), _T( "table update" ) };
+
+  // merged histograms are too large for the stack
+  LatencyHistogram* merged = (LatencyHistogram*)VirtualAlloc( NULL, sizeof( LatencyHistogram ) * (int)LatencyPhase::Count, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+  if ( !merged )
+    return;
+
+  threadRegistry.ForEach( [ & ]( ThreadRecord& record )
+  {
+    for ( int x = 0; x < (int)LatencyPhase::Count; x++ )
+      merged[ x ].Merge( record.latency[ x ] );
+  } );
+
+  TCHAR buffer[ 1024 ];
+  OutputDebugString( _T( "\n--- Tracker latency in cycles ---\n\n" ) );
+  _sntprintf_s( buffer, 1023, _T( "%-16s %12s %10s %10s %10s %10s\n\0" ), _T( "phase" ), _T( "count" ), _T( "p50" ), _T( "p99" ), _T( "p99.9" ), _T( "max" ) );
+  OutputDebugString( buffer );
+
+  for ( int x = 0; x < (int)LatencyPhase::Count; x++ )
+  {
+    unsigned long long total = 0;
+    for ( int y = 0; y < LatencyHistogram::bucketCount; y++ )
+      total += merged[ x ].counts[ y ];
+
+    _sntprintf_s( buffer, 1023, _T( "%-16s %12llu %10llu %10llu %10llu %10llu\n\0" ), phaseNames[ x ], total,
+                  merged[ x ].GetPercentile( total, 50 ), merged[ x ].GetPercentile( total, 99 ),
+                  merged[ x ].GetPercentile( total, 99.9 ), merged[ x ].maxValue );
+    OutputDebugString( buffer );
+  }
+  OutputDebugString( _T( "\n" ) );
+
+  VirtualFree( merged, 0, MEM_RELEASE );
 }
+#else
+#define LATENCY_START( name )
+#define LATENCY_RECORD( phase, name )
+#endif // ENABLE_LATENCY_HISTOGRAMS
 
-void __cdecl operator delete( void* pointer )
+#if ENABLE_NO_ALLOC_ZONES
+thread_local int noAllocDepth = 0;
+std::atomic<unsigned long long> noAllocViolations;
+
+void ReportNoAllocViolation( const TCHAR* message )
 {
-  LeakTracker::memTracker.RemovePointer( pointer );
-  free( pointer );
+  noAllocViolations.fetch_add( 1, std::memory_order_relaxed );
+#if NO_ALLOC_POLICY >= 1
+  // the report itself may allocate
+  int depth = noAllocDepth;
+  noAllocDepth = 0;
+  OutputDebugString( message );
+#ifdef ENABLE_STACK_TRACE
+  StackTracker s( INNER_STACK_OFFSET );
+  s.DumpToDebugOutput();
+#endif // ENABLE_STACK_TRACE
+  noAllocDepth = depth;
+#endif // NO_ALLOC_POLICY >= 1
+#if NO_ALLOC_POLICY >= 2
+  if ( IsDebuggerPresent() )
+    __debugbreak();
+  else
+    abort();
+#endif // NO_ALLOC_POLICY >= 2
+}
+#endif // ENABLE_NO_ALLOC_ZONES
+
+#ifdef ENABLE_MEMORY_LEAK_TRACKING
+
+// Memory for the tracker's own big metadata regions. These bypass the heap and
+// use large pages where possible. The statistics are only updated under the
+// tracker lock.
+size_t metadataBytes = 0;
+size_t largePageMetadataBytes = 0;
+
+#if ENABLE_LARGE_PAGES
+size_t GetLargePageSize()
+{
+  static bool initialized = false;
+  static size_t largePageSize = 0;
+  if ( initialized )
+    return largePageSize;
+  initialized = true;
+
+  HANDLE token;
+  if ( OpenProcessToken( GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token ) )
+  {
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[ 0 ].Attributes = SE_PRIVILEGE_ENABLED;
+    if ( LookupPrivilegeValue( NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[ 0 ].Luid ) &&
+         AdjustTokenPrivileges( token, FALSE, &privileges, 0, NULL, NULL ) && GetLastError() == ERROR_SUCCESS )
+      largePageSize = GetLargePageMinimum();
+    CloseHandle( token );
+  }
+
+  if ( !largePageSize )
+    OutputDebugString( _T( "**** WARNING: Large pages unavailable (SeLockMemoryPrivilege not held), tracker metadata uses regular pages\n" ) );
+  return largePageSize;
+}
+#endif // ENABLE_LARGE_PAGES
+
+struct MetadataRegion
+{
+  void* memory = nullptr;
+  size_t size = 0;
+  bool largePages = false;
+
+  bool Allocate( size_t requestedSize )
+  {
+#if ENABLE_LARGE_PAGES
+    size_t pageSize = GetLargePageSize();
+    if ( pageSize && requestedSize >= pageSize )
+    {
+      size = ( requestedSize + pageSize - 1 ) & ~( pageSize - 1 );
+      memory = VirtualAlloc( NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE );
+      largePages = memory != nullptr;
+    }
+#endif // ENABLE_LARGE_PAGES
+
+    if ( !memory )
+    {
+      size = requestedSize;
+      memory = VirtualAlloc( NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    }
+    if ( !memory )
+      return false;
+
+    metadataBytes += size;
+    if ( largePages )
+      largePageMetadataBytes += size;
+    return true;
+  }
+
+  void Release()
+  {
+    if ( !memory )
+      return;
+
+    VirtualFree( memory, 0, MEM_RELEASE );
+    metadataBytes -= size;
+    if ( largePages )
+      largePageMetadataBytes -= size;
+    *this = MetadataRegion();
+  }
+};
+
+// Open addressing hash table keyed by pointers, used as the tracker's pool.
+// Each slot has a control byte that is either empty, deleted or holds 7 bits
+// of the key's hash. Lookups compare a whole group of 16 control bytes at once
+// (with SSE2 where available) and only touch the entries whose control byte
+// matches, so a lookup typically costs a single cache miss on the entries.
+// Storage is allocated as metadata regions so the table never recurses into
+// the tracked operator new.
+// Growing never rehashes the whole table at once: the old storage is kept
+// around and a few groups are migrated on every insert and erase, so no
+// single operation pays for moving millions of entries under the lock.
+// Entries can be specialized per value type to pack the key
+template<typename Value>
+struct TableEntry
+{
+  const void* key;
+  Value value;
+
+  TableEntry( const void* key, const Value& value )
+    : key( key ), value( value )
+  {
+  }
+
+  const void* GetKey() const
+  {
+    return key;
+  }
+
+#if ENABLE_DUMP_DESCRIPTOR
+  static void DescribeLayout( DumpDescriptor& descriptor )
+  {
+    descriptor.entrySize = sizeof( TableEntry );
+    descriptor.keyOffset = offsetof( TableEntry, key );
+    Value::DescribeLayout( descriptor, offsetof( TableEntry, value ) );
+  }
+#endif // ENABLE_DUMP_DESCRIPTOR
+};
+
+template<typename Value>
+class PointerTable
+{
+public:
+  typedef TableEntry<Value> Entry;
+
+private:
+  static const size_t groupSize = 16;
+  static const signed char emptySlot = -128;
+  static const signed char deletedSlot = -2;
+
+  static uint64_t Hash( const void* key )
+  {
+    uint64_t h = (uint64_t)(uintptr_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+  }
+
+  static signed char H2( uint64_t hash )
+  {
+    return (signed char)( hash >> 57 );
+  }
+
+  static unsigned int LowestBit( unsigned int mask )
+  {
+    unsigned long index;
+    _BitScanForward( &index, mask );
+    return index;
+  }
+
+  static size_t MaxLoad( size_t capacity )
+  {
+    return capacity - capacity / 8;
+  }
+
+  class Group
+  {
+#ifdef POINTER_TABLE_SSE2
+    __m128i ctrl;
+
+  public:
+    Group( const signed char* p )
+      : ctrl( _mm_load_si128( (const __m128i*)p ) )
+    {
+    }
+
+    unsigned int Match( signed char h2 ) const
+    {
+      return _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_set1_epi8( h2 ), ctrl ) );
+    }
+
+    // empty and deleted are the only control values with the sign bit set
+    unsigned int MatchEmptyOrDeleted() const
+    {
+      return _mm_movemask_epi8( ctrl );
+    }
+#else
+    const signed char* ctrl;
+
+  public:
+    Group( const signed char* p )
+      : ctrl( p )
+    {
+    }
+
+    unsigned int Match( signed char h2 ) const
+    {
+      unsigned int mask = 0;
+      for ( size_t x = 0; x < groupSize; x++ )
+        mask |= ( ctrl[ x ] == h2 ) << x;
+      return mask;
+    }
+
+    unsigned int MatchEmptyOrDeleted() const
+    {
+      unsigned int mask = 0;
+      for ( size_t x = 0; x < groupSize; x++ )
+        mask |= ( ctrl[ x ] < 0 ) << x;
+      return mask;
+    }
+#endif // POINTER_TABLE_SSE2
+
+    unsigned int MatchEmpty() const
+    {
+      return Match( emptySlot );
+    }
+  };
+
+  struct Storage
+  {
+    MetadataRegion controlRegion;
+    MetadataRegion entryRegion;
+    signed char* control = nullptr;
+    Entry* entries = nullptr;
+    size_t capacity = 0;
+    size_t count = 0;
+    size_t growthLeft = 0;
+
+    bool Allocate( size_t newCapacity )
+    {
+      if ( !controlRegion.Allocate( newCapacity ) || !entryRegion.Allocate( newCapacity * sizeof( Entry ) ) )
+      {
+        Release();
+        return false;
+      }
+
+      control = (signed char*)controlRegion.memory;
+      entries = (Entry*)entryRegion.memory;
+      memset( control, emptySlot, newCapacity );
+      capacity = newCapacity;
+      count = 0;
+      growthLeft = MaxLoad( newCapacity );
+      return true;
+    }
+
+    void Release()
+    {
+      controlRegion.Release();
+      entryRegion.Release();
+      *this = Storage();
+    }
+
+    bool Contains( const Entry* entry ) const
+    {
+      return entry >= entries && entry < entries + capacity;
+    }
+
+    // Probes groups in triangular order which visits every group of a power of two sized table
+    template<typename F>
+    size_t Probe( uint64_t hash, F visitGroup ) const
+    {
+      size_t groupMask = capacity / groupSize - 1;
+      size_t group = (size_t)hash & groupMask;
+      for ( size_t step = 1;; step++ )
+      {
+        size_t slot = visitGroup( group * groupSize, Group( control + group * groupSize ) );
+        if ( slot != SIZE_MAX )
+          return slot;
+        group = ( group + step ) & groupMask;
+      }
+    }
+
+    Entry* Find( const void* key ) const
+    {
+      if ( !count )
+        return nullptr;
+
+      uint64_t hash = Hash( key );
+      signed char h2 = H2( hash );
+      size_t result = SIZE_MAX;
+      Probe( hash, [ & ]( size_t first, const Group& group ) -> size_t
+      {
+        for ( unsigned int match = group.Match( h2 ); match; match &= match - 1 )
+        {
+          size_t slot = first + LowestBit( match );
+          if ( entries[ slot ].GetKey() == key )
+            return result = slot;
+        }
+        return group.MatchEmpty() ? first : SIZE_MAX;
+      } );
+      return result != SIZE_MAX ? &entries[ result ] : nullptr;
+    }
+
+    // The caller makes sure the key isn't present and growthLeft isn't zero
+    Entry* Insert( const void* key )
+    {
+      uint64_t hash = Hash( key );
+      size_t slot = Probe( hash, [ & ]( size_t first, const Group& group ) -> size_t
+      {
+        unsigned int free = group.MatchEmptyOrDeleted();
+        return free ? first + LowestBit( free ) : SIZE_MAX;
+      } );
+
+      if ( control[ slot ] == emptySlot )
+        growthLeft--;
+      control[ slot ] = H2( hash );
+      count++;
+      return &entries[ slot ];
+    }
+
+    void Erase( Entry* entry )
+    {
+      size_t slot = entry - entries;
+      entry->~Entry();
+      count--;
+
+      // a group that still has an empty slot never had a probe sequence continue
+      // past it, so the slot can become empty instead of a tombstone
+      if ( Group( control + slot / groupSize * groupSize ).MatchEmpty() )
+      {
+        control[ slot ] = emptySlot;
+        growthLeft++;
+      }
+      else
+        control[ slot ] = deletedSlot;
+    }
+  };
+
+  Storage current;
+  Storage previous; // only allocated while a resize is in progress
+  size_t migratedGroups = 0;
+
+  // Moves the next few groups of the previous storage over. Migrated slots become
+  // tombstones so lookups for keys that haven't moved yet still probe past them.
+  void Migrate( size_t groupCount )
+  {
+    if ( !previous.control )
+      return;
+
+    size_t totalGroups = previous.capacity / groupSize;
+    for ( size_t x = 0; x < groupCount && migratedGroups < totalGroups; x++, migratedGroups++ )
+    {
+      for ( size_t slot = migratedGroups * groupSize; slot < ( migratedGroups + 1 ) * groupSize; slot++ )
+      {
+        if ( previous.control[ slot ] < 0 )
+          continue;
+
+        Entry& entry = previous.entries[ slot ];
+        new ( current.Insert( entry.GetKey() ) ) Entry( std::move( entry ) );
+        entry.~Entry();
+        previous.control[ slot ] = deletedSlot;
+        previous.count--;
+      }
+    }
+
+    if ( migratedGroups == totalGroups )
+      previous.Release();
+  }
+
+  bool StartResize()
+  {
+    // a resize still in progress is finished first, this can only happen if
+    // POINTER_TABLE_MIGRATION_GROUPS is too low for the growth rate
+    Migrate( SIZE_MAX );
+
+    // tables mostly filled with deleted slots are rebuilt at the same size
+    size_t newCapacity = current.count < MaxLoad( current.capacity ) / 2 ? current.capacity : current.capacity * 2;
+    if ( newCapacity < POINTER_TABLE_INITIAL_CAPACITY )
+      newCapacity = POINTER_TABLE_INITIAL_CAPACITY;
+
+    Storage resized;
+    if ( !resized.Allocate( newCapacity ) )
+      return false;
+
+    previous = current;
+    current = resized;
+    migratedGroups = 0;
+    Migrate( POINTER_TABLE_MIGRATION_GROUPS );
+    return true;
+  }
+
+public:
+
+  ~PointerTable()
+  {
+    ForEach( []( Entry& entry ) { entry.~Entry(); } );
+    current.Release();
+    previous.Release();
+  }
+
+  size_t Size() const
+  {
+    return current.count + previous.count;
+  }
+
+#if ENABLE_DUMP_DESCRIPTOR
+  static void DescribeLayout( DumpDescriptor& descriptor )
+  {
+    descriptor.storageOffsets[ 0 ] = offsetof( PointerTable, current );
+    descriptor.storageOffsets[ 1 ] = offsetof( PointerTable, previous );
+    descriptor.controlOffset = offsetof( Storage, control );
+    descriptor.entriesOffset = offsetof( Storage, entries );
+    descriptor.capacityOffset = offsetof( Storage, capacity );
+    Entry::DescribeLayout( descriptor );
+  }
+#endif // ENABLE_DUMP_DESCRIPTOR
+
+  // Slots are numbered across both storages while a resize is in progress
+  size_t Capacity() const
+  {
+    return current.capacity + previous.capacity;
+  }
+
+  // Returns the entry in the given slot, or nullptr if the slot is unused
+  Entry* GetSlot( size_t slot )
+  {
+    const Storage& storage = slot < current.capacity ? current : previous;
+    if ( slot >= current.capacity )
+      slot -= current.capacity;
+    return storage.control[ slot ] >= 0 ? &storage.entries[ slot ] : nullptr;
+  }
+
+  Entry* Find( const void* key )
+  {
+    Entry* entry = current.Find( key );
+    return entry || !previous.count ? entry : previous.Find( key );
+  }
+
+  bool InsertOrAssign( const void* key, const Value& value )
+  {
+    Migrate( POINTER_TABLE_MIGRATION_GROUPS );
+
+    if ( Entry* entry = Find( key ) )
+    {
+      entry->value = value;
+      return true;
+    }
+
+    if ( !current.growthLeft && !StartResize() )
+      return false;
+
+    new ( current.Insert( key ) ) Entry( key, value );
+    return true;
+  }
+
+  void Erase( Entry* entry )
+  {
+    if ( previous.Contains( entry ) )
+      previous.Erase( entry );
+    else
+      current.Erase( entry );
+
+    Migrate( POINTER_TABLE_MIGRATION_GROUPS );
+  }
+
+  template<typename F>
+  void ForEach( F fn )
+  {
+    for ( size_t x = 0; x < Capacity(); x++ )
+      if ( Entry* entry = GetSlot( x ) )
+        fn( *entry );
+  }
+};
+
+#if ENABLE_HEAP_CANARIES || ENABLE_PER_THREAD_TABLES
+#define USE_BLOCK_HEADERS
+
+// Blocks with headers are laid out as
+// [BlockHeader][front canary][user data][back canary]
+// with the canaries only present when ENABLE_HEAP_CANARIES is set.
+struct BlockHeader
+{
+  size_t size;
+#if ENABLE_PER_THREAD_TABLES
+  ThreadRecord* owner;
+  void* nextRemoteFree;
+#endif // ENABLE_PER_THREAD_TABLES
+};
+
+// keeps the user data 16 byte aligned on x64
+const size_t blockHeaderSize = ( sizeof( BlockHeader ) + 15 ) & ~(size_t)15;
+
+#if ENABLE_HEAP_CANARIES
+const size_t canarySize = HEAP_CANARY_SIZE;
+#else
+const size_t canarySize = 0;
+#endif // ENABLE_HEAP_CANARIES
+
+BlockHeader* GetBlockHeader( const void* p )
+{
+  return (BlockHeader*)( (unsigned char*)p - canarySize - blockHeaderSize );
+}
+#endif // ENABLE_HEAP_CANARIES || ENABLE_PER_THREAD_TABLES
+
+#if ENABLE_HEAP_CANARIES
+const unsigned char canaryValue = 0xfd; // same as the CRT's no man's land fill
+
+unsigned char* GetFrontCanary( const void* p )
+{
+  return (unsigned char*)p - HEAP_CANARY_SIZE;
+}
+
+unsigned char* GetBackCanary( const void* p )
+{
+  return (unsigned char*)p + GetBlockHeader( p )->size;
+}
+
+bool IsCanaryIntact( const unsigned char* canary )
+{
+  for ( int x = 0; x < HEAP_CANARY_SIZE; x++ )
+    if ( canary[ x ] != canaryValue )
+      return false;
+  return true;
+}
+#endif // ENABLE_HEAP_CANARIES
+
+void* AllocateRaw( size_t size );
+
+#ifdef USE_BLOCK_HEADERS
+void* AllocateWithHeader( size_t size )
+{
+  BlockHeader* header = (BlockHeader*)AllocateRaw( blockHeaderSize + canarySize + size + canarySize );
+  if ( !header )
+    return nullptr;
+
+  memset( header, 0, sizeof( BlockHeader ) );
+  header->size = size;
+  unsigned char* p = (unsigned char*)header + blockHeaderSize + canarySize;
+#if ENABLE_HEAP_CANARIES
+  memset( GetFrontCanary( p ), canaryValue, HEAP_CANARY_SIZE );
+  memset( p + size, canaryValue, HEAP_CANARY_SIZE );
+#endif // ENABLE_HEAP_CANARIES
+  return p;
+}
+
+void FreeWithHeader( void* p )
+{
+  if ( p )
+    free( GetBlockHeader( p ) );
+}
+#endif // USE_BLOCK_HEADERS
+
+#if ENABLE_GUARDED_SAMPLING
+// Sampled allocations are served from a pool of single page slots separated by
+// PAGE_NOACCESS guard pages. Blocks are randomly placed at the start or the end
+// of their slot so both underflows and overflows hit a guard page, and freed
+// slots are protected as well until they're reused, catching use after free.
+// The pool is lazily initialized and has no constructor as allocations may
+// arrive before any static initializer has run.
+class GuardedPool
+{
+  struct Slot
+  {
+    unsigned char* block;
+    size_t size;
+    bool inUse;
+    bool freed;
+#ifdef ENABLE_STACK_TRACE
+    StackTracker allocStack;
+    StackTracker freeStack;
+#endif // ENABLE_STACK_TRACE
+#if ENABLE_PER_THREAD_TABLES
+    ThreadRecord* owner;
+#endif // ENABLE_PER_THREAD_TABLES
+  };
+
+  SRWLOCK lock;
+  bool initialized;
+  size_t pageSize;
+  unsigned char* region;
+  unsigned char* regionEnd;
+  Slot* slots; // plain zeroed memory from VirtualAlloc
+  int freeSlots[ GUARDED_SLOT_COUNT ]; // fifo so freed slots stay protected for as long as possible
+  int freeHead;
+  int freeCount;
+
+  static thread_local int sampleCountdown;
+  static thread_local unsigned int randomState;
+
+  static unsigned int Random()
+  {
+    if ( !randomState )
+      randomState = GetCurrentThreadId() * 2654435761u | 1;
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+  }
+
+  bool Initialize()
+  {
+    SYSTEM_INFO info;
+    GetSystemInfo( &info );
+    pageSize = info.dwPageSize;
+
+    size_t regionSize = ( 2 * GUARDED_SLOT_COUNT + 1 ) * pageSize;
+    region = (unsigned char*)VirtualAlloc( NULL, regionSize, MEM_RESERVE | MEM_COMMIT, PAGE_NOACCESS );
+    slots = (Slot*)VirtualAlloc( NULL, sizeof( Slot ) * GUARDED_SLOT_COUNT, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    if ( !region || !slots )
+      return false;
+
+    for ( int x = 0; x < GUARDED_SLOT_COUNT; x++ )
+      freeSlots[ x ] = x;
+    freeCount = GUARDED_SLOT_COUNT;
+
+    AddVectoredExceptionHandler( 1, FaultHandler );
+    regionEnd = region + regionSize; // publishing the region enables Owns()
+    return true;
+  }
+
+  unsigned char* GetSlotPage( int slot )
+  {
+    return region + ( 2 * slot + 1 ) * pageSize;
+  }
+
+  Slot& GetSlot( const void* p )
+  {
+    return slots[ ( (const unsigned char*)p - region ) / pageSize / 2 ];
+  }
+
+  void ReportFault( unsigned char* address, ULONG_PTR accessType )
+  {
+    size_t page = ( address - region ) / pageSize;
+
+    // guard pages are attributed to the neighbouring block closest to the faulting address
+    int slotIndex = (int)( page / 2 );
+    if ( !( page & 1 ) )
+    {
+      if ( page == 0 )
+        slotIndex = 0;
+      else if ( page / 2 >= GUARDED_SLOT_COUNT )
+        slotIndex = GUARDED_SLOT_COUNT - 1;
+      else
+      {
+        Slot& left = slots[ page / 2 - 1 ];
+        Slot& right = slots[ page / 2 ];
+        size_t leftDistance = left.block ? address - ( left.block + left.size ) : SIZE_MAX;
+        size_t rightDistance = right.block ? right.block - address : SIZE_MAX;
+        slotIndex = leftDistance <= rightDistance ? (int)( page / 2 - 1 ) : (int)( page / 2 );
+      }
+    }
+
+    Slot& slot = slots[ slotIndex ];
+    const TCHAR* access = accessType == 0 ? _T( "read" ) : accessType == 1 ? _T( "write" ) : _T( "execute" );
+    const TCHAR* kind = slot.freed && address >= slot.block && address < slot.block + slot.size ? _T( "use after free" ) : address < slot.block ? _T( "buffer underflow" ) : _T( "buffer overflow" );
+
+    TCHAR buffer[ 1024 ];
+    _sntprintf_s( buffer, 1023, _T( "**** ERROR: Guarded allocation fault: %s %s at %p, %zu byte block at %p\n\0" ), kind, access, address, slot.size, slot.block );
+    OutputDebugString( buffer );
+    DumpSlotStacks( slot );
+  }
+
+  void DumpSlotStacks( Slot& slot )
+  {
+#ifdef ENABLE_STACK_TRACE
+    OutputDebugString( _T( "\tAllocated at:\n" ) );
+    slot.allocStack.DumpToDebugOutput();
+    if ( slot.freed )
+    {
+      OutputDebugString( _T( "\tFreed at:\n" ) );
+      slot.freeStack.DumpToDebugOutput();
+    }
+#endif // ENABLE_STACK_TRACE
+  }
+
+  static LONG NTAPI FaultHandler( PEXCEPTION_POINTERS exception );
+
+public:
+
+  // The unsampled path of every allocation is this single decrement
+  bool ShouldSample()
+  {
+    if ( --sampleCountdown > 0 )
+      return false;
+
+    bool sample = sampleCountdown == 0; // a fresh thread starts below zero and only gets seeded
+    sampleCountdown = 1 + Random() % ( 2 * GUARDED_SAMPLE_RATE );
+    return sample;
+  }
+
+  bool Owns( const void* p )
+  {
+    return p >= region && p < regionEnd;
+  }
+
+  size_t GetSize( const void* p )
+  {
+    return GetSlot( p ).size;
+  }
+
+#if ENABLE_PER_THREAD_TABLES
+  ThreadRecord*& GetOwner( const void* p )
+  {
+    return GetSlot( p ).owner;
+  }
+#endif // ENABLE_PER_THREAD_TABLES
+
+  void* Allocate( size_t size )
+  {
+    if ( size > pageSize && initialized )
+      return nullptr;
+
+    AcquireSRWLockExclusive( &lock );
+    if ( !initialized )
+      initialized = Initialize();
+
+    if ( !region || !slots || !freeCount || size > pageSize )
+    {
+      ReleaseSRWLockExclusive( &lock );
+      return nullptr;
+    }
+
+    int slotIndex = freeSlots[ freeHead ];
+    freeHead = ( freeHead + 1 ) % GUARDED_SLOT_COUNT;
+    freeCount--;
+
+    unsigned char* page = GetSlotPage( slotIndex );
+    DWORD oldProtect;
+    VirtualProtect( page, pageSize, PAGE_READWRITE, &oldProtect );
+
+    Slot& slot = slots[ slotIndex ];
+    size_t alignedSize = ( ( size ? size : 1 ) + 15 ) & ~(size_t)15;
+    slot.block = ( Random() & 1 ) ? page : page + pageSize - alignedSize;
+    slot.size = size;
+    slot.inUse = true;
+    slot.freed = false;
+#if ENABLE_PER_THREAD_TABLES
+    slot.owner = nullptr;
+#endif // ENABLE_PER_THREAD_TABLES
+#ifdef ENABLE_STACK_TRACE
+    slot.allocStack = StackTracker( INNER_STACK_OFFSET );
+#endif // ENABLE_STACK_TRACE
+    ReleaseSRWLockExclusive( &lock );
+
+    return slot.block;
+  }
+
+  void Free( void* p )
+  {
+    AcquireSRWLockExclusive( &lock );
+    int slotIndex = (int)( ( (unsigned char*)p - region ) / pageSize / 2 );
+    Slot& slot = slots[ slotIndex ];
+    if ( !slot.inUse || slot.block != p )
+    {
+      TCHAR buffer[ 1024 ];
+      _sntprintf_s( buffer, 1023, _T( "**** ERROR: Invalid free of guarded allocation %p (%s)\n\0" ), p, slot.inUse ? _T( "not the start of the block" ) : _T( "already freed" ) );
+      OutputDebugString( buffer );
+      DumpSlotStacks( slot );
+      ReleaseSRWLockExclusive( &lock );
+      return;
+    }
+
+    slot.inUse = false;
+    slot.freed = true;
+#ifdef ENABLE_STACK_TRACE
+    slot.freeStack = StackTracker( INNER_STACK_OFFSET );
+#endif // ENABLE_STACK_TRACE
+
+    DWORD oldProtect;
+    VirtualProtect( GetSlotPage( slotIndex ), pageSize, PAGE_NOACCESS, &oldProtect );
+    freeSlots[ ( freeHead + freeCount ) % GUARDED_SLOT_COUNT ] = slotIndex;
+    freeCount++;
+    ReleaseSRWLockExclusive( &lock );
+  }
+};
+
+thread_local int GuardedPool::sampleCountdown = 0;
+thread_local unsigned int GuardedPool::randomState = 0;
+
+GuardedPool guardedPool;
+
+LONG NTAPI GuardedPool::FaultHandler( PEXCEPTION_POINTERS exception )
+{
+  PEXCEPTION_RECORD record = exception->ExceptionRecord;
+  if ( record->ExceptionCode == EXCEPTION_ACCESS_VIOLATION && record->NumberParameters >= 2 && guardedPool.Owns( (void*)record->ExceptionInformation[ 1 ] ) )
+    guardedPool.ReportFault( (unsigned char*)record->ExceptionInformation[ 1 ], record->ExceptionInformation[ 0 ] );
+  return EXCEPTION_CONTINUE_SEARCH;
+}
+#endif // ENABLE_GUARDED_SAMPLING
+
+#if ENABLE_COMPACT_ENTRIES
+#ifdef ENABLE_STACK_TRACE
+// Interns allocation stacks. Each unique stack is stored once and referred to
+// by a 32 bit id. Frames are stored as 32 bit offsets into the module that
+// contains them, code outside of modules is assigned to the 4 GB region
+// around it instead.
+// Lookups of known stacks only take the lock shared, modules are resolved
+// when a new stack is added.
+class StackDepot
+{
+  struct Module
+  {
+    uintptr_t base;
+    uint64_t size;
+  };
+
+  struct Stack
+  {
+    uint16_t modules[ STACK_TRACE_DEPTH ];
+    uint32_t offsets[ STACK_TRACE_DEPTH ];
+  };
+
+  static const uint16_t noModule = 0xffff;
+  static const uint32_t maxModules = 4096;
+  static const uint32_t stacksPerChunk = 4096;
+  static const uint32_t maxChunks = 16384;
+
+  SRWLOCK lock = SRWLOCK_INIT;
+  Module modules[ maxModules ];
+  uint32_t moduleCount = 0;
+  MetadataRegion chunks[ maxChunks ];
+  uint32_t stackCount = 0;
+  PointerTable<uint32_t> index; // keyed by the hash of the raw frames
+
+  static const void* Hash( void* const* frames )
+  {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for ( int x = 0; x < STACK_TRACE_DEPTH; x++ )
+      hash = ( hash ^ (uintptr_t)frames[ x ] ) * 0x100000001b3ull;
+    return (const void*)(uintptr_t)hash;
+  }
+
+  Stack& GetStack( uint32_t id )
+  {
+    return ( (Stack*)chunks[ id / stacksPerChunk ].memory )[ id % stacksPerChunk ];
+  }
+
+  void* DecodeFrame( const Stack& stack, int x ) const
+  {
+    if ( stack.modules[ x ] == noModule )
+      return nullptr;
+    return (void*)( modules[ stack.modules[ x ] ].base + stack.offsets[ x ] );
+  }
+
+  bool Matches( const Stack& stack, void* const* frames ) const
+  {
+    for ( int x = 0; x < STACK_TRACE_DEPTH; x++ )
+      if ( DecodeFrame( stack, x ) != frames[ x ] )
+        return false;
+    return true;
+  }
+
+  uint16_t GetModuleIndex( uintptr_t address )
+  {
+    for ( uint32_t x = 0; x < moduleCount; x++ )
+      if ( (uint64_t)( address - modules[ x ].base ) < modules[ x ].size )
+        return (uint16_t)x;
+
+    if ( moduleCount == maxModules )
+      return noModule;
+
+    Module& module = modules[ moduleCount ];
+    HMODULE handle;
+    if ( GetModuleHandleEx( GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCTSTR)address, &handle ) )
+    {
+      const IMAGE_DOS_HEADER* dosHeader = (const IMAGE_DOS_HEADER*)handle;
+      const IMAGE_NT_HEADERS* ntHeaders = (const IMAGE_NT_HEADERS*)( (const char*)handle + dosHeader->e_lfanew );
+      module.base = (uintptr_t)handle;
+      module.size = ntHeaders->OptionalHeader.SizeOfImage;
+    }
+    else
+    {
+      module.base = (uintptr_t)( (uint64_t)address & ~0xffffffffull );
+      module.size = 0x100000000ull;
+    }
+    return (uint16_t)moduleCount++;
+  }
+
+  // Returns SIZE_MAX if the stack is unknown
+  size_t FindStack( const void* hash, void* const* frames )
+  {
+    auto entry = index.Find( hash );
+    return entry && Matches( GetStack( entry->value ), frames ) ? entry->value : SIZE_MAX;
+  }
+
+public:
+  static const uint32_t invalidId = 0xffffffff;
+
+  uint32_t Intern( void* const* frames )
+  {
+    const void* hash = Hash( frames );
+
+    AcquireSRWLockShared( &lock );
+    size_t id = FindStack( hash, frames );
+    ReleaseSRWLockShared( &lock );
+    if ( id != SIZE_MAX )
+      return (uint32_t)id;
+
+    AcquireSRWLockExclusive( &lock );
+    id = FindStack( hash, frames );
+    if ( id == SIZE_MAX && stackCount < maxChunks * stacksPerChunk )
+    {
+      MetadataRegion& chunk = chunks[ stackCount / stacksPerChunk ];
+      if ( chunk.memory || chunk.Allocate( stacksPerChunk * sizeof( Stack ) ) )
+      {
+        id = stackCount++;
+        Stack& stack = GetStack( (uint32_t)id );
+        for ( int x = 0; x < STACK_TRACE_DEPTH; x++ )
+        {
+          stack.modules[ x ] = frames[ x ] ? GetModuleIndex( (uintptr_t)frames[ x ] ) : noModule;
+          stack.offsets[ x ] = stack.modules[ x ] != noModule ? (uint32_t)( (uintptr_t)frames[ x ] - modules[ stack.modules[ x ] ].base ) : 0;
+        }
+
+        // on a hash collision the new stack is stored but not indexed
+        if ( !index.Find( hash ) )
+          index.InsertOrAssign( hash, (uint32_t)id );
+      }
+    }
+    ReleaseSRWLockExclusive( &lock );
+    return id != SIZE_MAX ? (uint32_t)id : invalidId;
+  }
+
+  StackTracker GetStackTracker( uint32_t id )
+  {
+    void* frames[ STACK_TRACE_DEPTH ] = {};
+    AcquireSRWLockShared( &lock );
+    if ( id < stackCount )
+    {
+      Stack& stack = GetStack( id );
+      for ( int x = 0; x < STACK_TRACE_DEPTH; x++ )
+        frames[ x ] = DecodeFrame( stack, x );
+    }
+    ReleaseSRWLockShared( &lock );
+    return StackTracker( frames );
+  }
+
+  uint32_t GetStackCount() const
+  {
+    return stackCount;
+  }
+
+  uint32_t GetModuleCount() const
+  {
+    return moduleCount;
+  }
+
+#if ENABLE_DUMP_DESCRIPTOR
+  void DescribeLayout( DumpDescriptor& descriptor )
+  {
+    descriptor.stackDepot = (uintptr_t)this;
+    descriptor.depotModulesOffset = offsetof( StackDepot, modules );
+    descriptor.depotModuleSize = sizeof( Module );
+    descriptor.depotChunksOffset = offsetof( StackDepot, chunks );
+    descriptor.depotChunkSize = sizeof( MetadataRegion );
+    descriptor.depotStackSize = sizeof( Stack );
+    descriptor.depotStackModulesOffset = offsetof( Stack, modules );
+    descriptor.depotStackOffsetsOffset = offsetof( Stack, offsets );
+    descriptor.depotStacksPerChunk = stacksPerChunk;
+  }
+#endif // ENABLE_DUMP_DESCRIPTOR
+};
+
+extern StackDepot stackDepot;
+#endif // ENABLE_STACK_TRACE
+
+#pragma pack( push, 2 )
+class AllocationInfo
+{
+  uint16_t sizeCode;
+
+#ifdef ENABLE_STACK_TRACE
+  uint32_t stackId;
+#endif // ENABLE_STACK_TRACE
+
+#if ENABLE_MODULE_ATTRIBUTION
+  uint16_t module;
+#endif // ENABLE_MODULE_ATTRIBUTION
+
+public:
+  AllocationInfo( size_t size, void* const* frames )
+    : sizeCode( EncodeSize( size ) )
+#ifdef ENABLE_STACK_TRACE
+    , stackId( stackDepot.Intern( frames ) )
+#endif // ENABLE_STACK_TRACE
+#if ENABLE_MODULE_ATTRIBUTION
+    , module( 0xffff )
+#endif // ENABLE_MODULE_ATTRIBUTION
+  {
+  }
+
+  size_t GetSize() const
+  {
+    return DecodeSize( sizeCode );
+  }
+
+  // Identifies the call site the block was allocated at
+  uint32_t GetSite() const
+  {
+#ifdef ENABLE_STACK_TRACE
+    return stackId;
+#else
+    return 0;
+#endif // ENABLE_STACK_TRACE
+  }
+
+#ifdef ENABLE_STACK_TRACE
+  StackTracker GetStack() const
+  {
+    return stackDepot.GetStackTracker( stackId );
+  }
+
+  void DumpStack()
+  {
+    stackDepot.GetStackTracker( stackId ).DumpToDebugOutput();
+  }
+#endif // ENABLE_STACK_TRACE
+
+#if ENABLE_MODULE_ATTRIBUTION
+  // The module the block is attributed to, ModuleMap::unknownModule if none
+  uint16_t GetModule() const
+  {
+    return module;
+  }
+
+  void SetModule( uint16_t owner )
+  {
+    module = owner;
+  }
+#endif // ENABLE_MODULE_ATTRIBUTION
+
+#if ENABLE_DUMP_DESCRIPTOR
+  static void DescribeLayout( DumpDescriptor& descriptor, size_t offset )
+  {
+    descriptor.sizeOffset = (uint32_t)( offset + offsetof( AllocationInfo, sizeCode ) );
+#ifdef ENABLE_STACK_TRACE
+    descriptor.stackOffset = (uint32_t)( offset + offsetof( AllocationInfo, stackId ) );
+#endif // ENABLE_STACK_TRACE
+  }
+#endif // ENABLE_DUMP_DESCRIPTOR
+};
+
+// Addresses are stored in 48 bits, which covers the user mode address space
+template<>
+struct TableEntry<AllocationInfo>
+{
+  uint16_t address[ 3 ];
+  AllocationInfo value;
+
+  TableEntry( const void* key, const AllocationInfo& value )
+    : value( value )
+  {
+    uint64_t bits = (uintptr_t)key;
+    address[ 0 ] = (uint16_t)bits;
+    address[ 1 ] = (uint16_t)( bits >> 16 );
+    address[ 2 ] = (uint16_t)( bits >> 32 );
+  }
+
+  const void* GetKey() const
+  {
+    return (const void*)(uintptr_t)( address[ 0 ] | (uint64_t)address[ 1 ] << 16 | (uint64_t)address[ 2 ] << 32 );
+  }
+
+#if ENABLE_DUMP_DESCRIPTOR
+  static void DescribeLayout( DumpDescriptor& descriptor )
+  {
+    descriptor.flags |= dumpCompactEntries;
+    descriptor.entrySize = sizeof( TableEntry );
+    descriptor.keyOffset = offsetof( TableEntry, address );
+    AllocationInfo::DescribeLayout( descriptor, offsetof( TableEntry, value ) );
+  }
+#endif // ENABLE_DUMP_DESCRIPTOR
+};
+#pragma pack( pop )
+#else
+class AllocationInfo
+{
+public:
+  size_t size;
+
+#ifdef ENABLE_STACK_TRACE
+  StackTracker stack;
+#endif // ENABLE_STACK_TRACE
+
+#if ENABLE_MODULE_ATTRIBUTION
+  uint16_t module;
+#endif // ENABLE_MODULE_ATTRIBUTION
+
+  AllocationInfo( size_t size, void* const* frames )
+    : size( size )
+#ifdef ENABLE_STACK_TRACE
+    , stack( frames )
+#endif // ENABLE_STACK_TRACE
+#if ENABLE_MODULE_ATTRIBUTION
+    , module( 0xffff )
+#endif // ENABLE_MODULE_ATTRIBUTION
+  {
+  }
+
+  size_t GetSize() const
+  {
+    return size;
+  }
+
+  // Identifies the call site the block was allocated at
+  uint32_t GetSite() const
+  {
+#ifdef ENABLE_STACK_TRACE
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for ( int x = 0; x < STACK_TRACE_DEPTH; x++ )
+      hash = ( hash ^ (uintptr_t)stack.GetFrames()[ x ] ) * 0x100000001b3ull;
+    return (uint32_t)( hash ^ hash >> 32 );
+#else
+    return 0;
+#endif // ENABLE_STACK_TRACE
+  }
+
+#ifdef ENABLE_STACK_TRACE
+  const StackTracker& GetStack() const
+  {
+    return stack;
+  }
+
+  void DumpStack()
+  {
+    stack.DumpToDebugOutput();
+  }
+#endif // ENABLE_STACK_TRACE
+
+#if ENABLE_MODULE_ATTRIBUTION
+  // The module the block is attributed to, ModuleMap::unknownModule if none
+  uint16_t GetModule() const
+  {
+    return module;
+  }
+
+  void SetModule( uint16_t owner )
+  {
+    module = owner;
+  }
+#endif // ENABLE_MODULE_ATTRIBUTION
+
+#if ENABLE_DUMP_DESCRIPTOR
+  // the frames are the first member of StackTracker
+  static void DescribeLayout( DumpDescriptor& descriptor, size_t offset )
+  {
+    descriptor.sizeOffset = (uint32_t)( offset + offsetof( AllocationInfo, size ) );
+#ifdef ENABLE_STACK_TRACE
+    descriptor.stackOffset = (uint32_t)( offset + offsetof( AllocationInfo, stack ) );
+#endif // ENABLE_STACK_TRACE
+  }
+#endif // ENABLE_DUMP_DESCRIPTOR
+};
+#endif // ENABLE_COMPACT_ENTRIES
+
+void ReleaseBlockMemory( void* p );
+
+#if ENABLE_PER_THREAD_TABLES
+ThreadRecord*& GetBlockOwner( const void* p )
+{
+#if ENABLE_GUARDED_SAMPLING
+  if ( guardedPool.Owns( p ) )
+    return guardedPool.GetOwner( p );
+#endif // ENABLE_GUARDED_SAMPLING
+  return GetBlockHeader( p )->owner;
+}
+
+// Link of a remotely freed block in its owner's queue. Guarded blocks have no
+// header but always span at least 16 bytes of their slot.
+void** GetRemoteFreeLink( void* p )
+{
+#if ENABLE_GUARDED_SAMPLING
+  if ( guardedPool.Owns( p ) )
+    return (void**)p;
+#endif // ENABLE_GUARDED_SAMPLING
+  return &GetBlockHeader( p )->nextRemoteFree;
+}
+
+// The allocation table of a single thread. Only the owning thread modifies it,
+// frees issued by other threads are pushed to remoteFrees and applied by the
+// owner on its next table update.
+// Other threads reading the table (reports, canary checks) raise 'inspected'
+// and wait for the owner to leave its update section. The owner checks the
+// flag after a fence, so its fast path has no lock and no contended write.
+// An owner that exited or stopped allocating never gets to its queue, so the
+// freeing thread drains it as an inspector once the queue gets long.
+struct OwnedTable
+{
+  static const uint32_t maxQueuedRemoteFrees = 4096;
+
+  PointerTable<AllocationInfo> table;
+  std::atomic<void*> remoteFrees{ nullptr };
+  std::atomic<uint32_t> queuedRemoteFrees{ 0 };
+  std::atomic<bool> ownerBusy{ false };
+  std::atomic<bool> inspected{ false };
+  size_t canarySlot = 0;
+
+  void BeginUpdate()
+  {
+    for ( ;; )
+    {
+      ownerBusy.store( true, std::memory_order_relaxed );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      if ( !inspected.load( std::memory_order_relaxed ) )
+        return;
+
+      ownerBusy.store( false, std::memory_order_release );
+      while ( inspected.load( std::memory_order_acquire ) )
+        SwitchToThread();
+    }
+  }
+
+  void EndUpdate()
+  {
+    ownerBusy.store( false, std::memory_order_release );
+  }
+
+  // Inspections are serialized by the caller
+  void BeginInspection()
+  {
+    inspected.store( true, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    while ( ownerBusy.load( std::memory_order_acquire ) )
+      SwitchToThread();
+  }
+
+  void EndInspection()
+  {
+    inspected.store( false, std::memory_order_release );
+  }
+
+  // Returns true if the queue got long enough for the caller to drain it
+  bool PushRemoteFree( void* p )
+  {
+    void** link = GetRemoteFreeLink( p );
+    void* head = remoteFrees.load( std::memory_order_relaxed );
+    do
+    {
+      *link = head;
+    } while ( !remoteFrees.compare_exchange_weak( head, p, std::memory_order_seq_cst, std::memory_order_relaxed ) );
+    return queuedRemoteFrees.fetch_add( 1, std::memory_order_relaxed ) + 1 == maxQueuedRemoteFrees;
+  }
+};
+
+#if ENABLE_DUMP_DESCRIPTOR
+void ThreadRegistry::DescribeLayout( DumpDescriptor& descriptor )
+{
+  descriptor.flags |= dumpPerThreadTables;
+  descriptor.threadRecords = (uintptr_t)&head;
+  descriptor.recordNextOffset = offsetof( ThreadRecord, next );
+  descriptor.recordTableOffset = offsetof( ThreadRecord, ownedTable );
+  descriptor.ownedTableOffset = offsetof( OwnedTable, table );
+}
+#endif // ENABLE_DUMP_DESCRIPTOR
+#endif // ENABLE_PER_THREAD_TABLES
+
+#if ENABLE_EVENT_RINGS
+// Connection to the analyzer process. The analyzer creates the shared section
+// before the tracked process starts; without one the tracker works in-process.
+class EventRingWriter
+{
+  HANDLE mapping = NULL;
+  HANDLE analyzer = NULL;
+  EventSection* section = nullptr;
+
+  bool IsAnalyzerAlive()
+  {
+    return WaitForSingleObject( analyzer, 0 ) == WAIT_TIMEOUT;
+  }
+
+public:
+
+  EventRingWriter()
+  {
+    TCHAR name[ 64 ];
+    GetEventSectionName( name, GetCurrentProcessId() );
+    mapping = OpenFileMapping( FILE_MAP_ALL_ACCESS, FALSE, name );
+    if ( !mapping )
+      return;
+
+    section = (EventSection*)MapViewOfFile( mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof( EventSection ) );
+    if ( section && ( section->magic != eventSectionMagic || section->version != eventSectionVersion || section->ringCount != EVENT_RING_COUNT ||
+                      section->ringCapacity != EVENT_RING_CAPACITY || section->stackDepth != STACK_TRACE_DEPTH ) )
+    {
+      OutputDebugString( _T( "**** ERROR: Analyzer was built with a different event ring configuration, tracking in-process instead\n" ) );
+      UnmapViewOfFile( section );
+      section = nullptr;
+    }
+
+    if ( section )
+      analyzer = OpenProcess( SYNCHRONIZE, FALSE, section->analyzerProcessId );
+    if ( !analyzer )
+    {
+      if ( section )
+        UnmapViewOfFile( section );
+      section = nullptr;
+      CloseHandle( mapping );
+      mapping = NULL;
+    }
+  }
+
+  // Hands over to the analyzer, which reports while the process and its modules are still around
+  ~EventRingWriter()
+  {
+    if ( !section )
+      return;
+
+    section->state.store( SessionState::Exiting, std::memory_order_release );
+    while ( section->state.load( std::memory_order_acquire ) != SessionState::Reported && IsAnalyzerAlive() )
+      Sleep( 1 );
+
+    UnmapViewOfFile( section );
+    CloseHandle( mapping );
+    CloseHandle( analyzer );
+  }
+
+  bool IsConnected() const
+  {
+    return section != nullptr;
+  }
+
+  void Write( EventType type, const void* p, size_t size, void* const* frames, uint32_t frameCount )
+  {
+    ThreadRecord* record = threadRegistry.GetCurrent();
+    if ( record && !record->eventRing )
+    {
+      uint32_t index = section->ringsInUse.fetch_add( 1, std::memory_order_relaxed );
+      if ( index < EVENT_RING_COUNT )
+        record->eventRing = &section->rings[ index ];
+    }
+
+    EventRing* ring = record ? record->eventRing : nullptr;
+    if ( !ring )
+    {
+      section->droppedEvents.fetch_add( 1, std::memory_order_relaxed );
+      return;
+    }
+
+    // a full ring waits for the analyzer, events are only lost if it went away
+    uint64_t write = ring->writeIndex.load( std::memory_order_relaxed );
+    while ( write - ring->readIndex.load( std::memory_order_acquire ) >= EVENT_RING_CAPACITY )
+    {
+      if ( !IsAnalyzerAlive() )
+      {
+        section->droppedEvents.fetch_add( 1, std::memory_order_relaxed );
+        return;
+      }
+      SwitchToThread();
+    }
+
+    TrackerEvent& event = ring->events[ write % EVENT_RING_CAPACITY ];
+    event.timestamp = __rdtsc();
+    event.address = (uintptr_t)p;
+    event.size = size;
+    event.type = type;
+    event.frameCount = frameCount;
+    for ( uint32_t x = 0; x < frameCount; x++ )
+      event.frames[ x ] = (uintptr_t)frames[ x ];
+    ring->writeIndex.store( write + 1, std::memory_order_release );
+  }
+};
+#endif // ENABLE_EVENT_RINGS
+
+#if ENABLE_EVENT_TRACE
+// The block of the event trace a thread is currently filling
+struct TraceBuffer
+{
+  TraceBlockHeader header;
+  uint64_t lastTime;
+  uint64_t lastAddress;
+  uint64_t stackHashes[ traceStackSlots ];
+  uint8_t data[ EVENT_TRACE_BLOCK_SIZE ];
+};
+
+class EventTraceWriter
+{
+  // head, address and size, then the frame count and frames
+  static const uint32_t maxEventBytes = 3 * 10 + ( STACK_TRACE_DEPTH + 1 ) * 10;
+
+  Mutex fileLock;
+  HANDLE file = INVALID_HANDLE_VALUE;
+  uint64_t startTime;
+  LARGE_INTEGER startCounter;
+
+  static uint8_t* WriteVarint( uint8_t* out, uint64_t value )
+  {
+    while ( value >= 0x80 )
+    {
+      *out++ = (uint8_t)( value | 0x80 );
+      value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+  }
+
+  void StartBlock( TraceBuffer& buffer, uint64_t now )
+  {
+    buffer.header.magic = traceBlockMagic;
+    buffer.header.threadId = GetCurrentThreadId();
+    buffer.header.baseTime = now;
+    buffer.header.byteCount = 0;
+    buffer.lastTime = now;
+    buffer.lastAddress = 0;
+    memset( buffer.stackHashes, 0, sizeof( buffer.stackHashes ) );
+  }
+
+  void Flush( TraceBuffer& buffer )
+  {
+    if ( !buffer.header.eventCount )
+      return;
+
+    Lock lock( fileLock );
+    DWORD written;
+    WriteFile( file, &buffer.header, sizeof( buffer.header ), &written, NULL );
+    WriteFile( file, buffer.data, buffer.header.byteCount, &written, NULL );
+    buffer.header.eventCount = 0;
+  }
+
+public:
+
+  EventTraceWriter()
+  {
+    file = CreateFile( _T( EVENT_TRACE_FILE ), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+    if ( file == INVALID_HANDLE_VALUE )
+    {
+      OutputDebugString( _T( "**** ERROR: Failed to create the event trace file\n" ) );
+      return;
+    }
+
+    TraceFileHeader header = { traceFileMagic, traceVersion, EVENT_TRACE_TIME_SHIFT, STACK_TRACE_DEPTH, 0 };
+    DWORD written;
+    WriteFile( file, &header, sizeof( header ), &written, NULL );
+
+    startTime = __rdtsc();
+    QueryPerformanceCounter( &startCounter );
+  }
+
+  ~EventTraceWriter()
+  {
+    if ( file == INVALID_HANDLE_VALUE )
+      return;
+
+    threadRegistry.ForEach( [ & ]( ThreadRecord& record )
+    {
+      if ( record.traceBuffer )
+        Flush( *record.traceBuffer );
+    } );
+
+    // the tsc rate is measured over the whole run so the analyzer can work in seconds
+    LARGE_INTEGER endCounter, frequency;
+    uint64_t endTime = __rdtsc();
+    QueryPerformanceCounter( &endCounter );
+    QueryPerformanceFrequency( &frequency );
+    if ( endCounter.QuadPart > startCounter.QuadPart )
+    {
+      TraceFileHeader header = { traceFileMagic, traceVersion, EVENT_TRACE_TIME_SHIFT, STACK_TRACE_DEPTH, 0 };
+      header.ticksPerSecond = (uint64_t)( ( endTime - startTime ) / ( (double)( endCounter.QuadPart - startCounter.QuadPart ) / frequency.QuadPart ) ) >> EVENT_TRACE_TIME_SHIFT;
+      LARGE_INTEGER start = {};
+      DWORD written;
+      SetFilePointerEx( file, start, NULL, FILE_BEGIN );
+      WriteFile( file, &header, sizeof( header ), &written, NULL );
+    }
+    CloseHandle( file );
+  }
+
+  void Record( EventType type, const void* p, size_t size, void* const* frames, uint32_t frameCount )
+  {
+    ThreadRecord* record = threadRegistry.GetCurrent();
+    if ( file == INVALID_HANDLE_VALUE || !record )
+      return;
+
+    if ( !record->traceBuffer )
+    {
+      record->traceBuffer = (TraceBuffer*)VirtualAlloc( NULL, sizeof( TraceBuffer ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+      if ( !record->traceBuffer )
+        return;
+    }
+
+    // blocks only hold events of one thread, and records are reused by new threads
+    TraceBuffer& buffer = *record->traceBuffer;
+    if ( buffer.header.eventCount && ( buffer.header.byteCount + maxEventBytes > EVENT_TRACE_BLOCK_SIZE || buffer.header.threadId != GetCurrentThreadId() ) )
+      Flush( buffer );
+
+    // the tsc of different cores may be slightly apart
+    uint64_t now = __rdtsc() >> EVENT_TRACE_TIME_SHIFT;
+    if ( !buffer.header.eventCount )
+      StartBlock( buffer, now );
+    if ( now < buffer.lastTime )
+      now = buffer.lastTime;
+
+    uint64_t stack[ STACK_TRACE_DEPTH ];
+    while ( frameCount && !frames[ frameCount - 1 ] )
+      frameCount--;
+    for ( uint32_t x = 0; x < frameCount; x++ )
+      stack[ x ] = (uintptr_t)frames[ x ];
+
+    uint64_t stackHash = 0;
+    uint32_t kind = TraceEventKind::Free;
+    if ( type == EventType::Allocate )
+    {
+      stackHash = TraceStackHash( stack, frameCount );
+      kind = buffer.stackHashes[ stackHash % traceStackSlots ] == stackHash ? TraceEventKind::Allocate : TraceEventKind::AllocateNewStack;
+    }
+
+    uint64_t address = (uintptr_t)p;
+    uint64_t addressDelta = address ^ buffer.lastAddress;
+    uint8_t* out = buffer.data + buffer.header.byteCount;
+    out = WriteVarint( out, ( now - buffer.lastTime ) << 2 | kind );
+    out = WriteVarint( out, addressDelta >> 4 | addressDelta << 60 );
+
+    if ( type == EventType::Allocate )
+    {
+      uint64_t classSize;
+      uint32_t sizeClass = GetTraceSizeClass( size, classSize );
+      out = WriteVarint( out, ( classSize - size ) << 7 | sizeClass );
+
+      if ( kind == TraceEventKind::Allocate )
+        out = WriteVarint( out, stackHash % traceStackSlots );
+      else
+      {
+        out = WriteVarint( out, frameCount );
+        uint64_t previous = 0;
+        for ( uint32_t x = 0; x < frameCount; x++ )
+        {
+          out = WriteVarint( out, stack[ x ] ^ previous );
+          previous = stack[ x ];
+        }
+        buffer.stackHashes[ stackHash % traceStackSlots ] = stackHash;
+      }
+    }
+
+    buffer.lastTime = now;
+    buffer.lastAddress = address;
+    buffer.header.byteCount = (uint32_t)( out - buffer.data );
+    buffer.header.eventCount++;
+  }
+};
+#endif // ENABLE_EVENT_TRACE
+
+#if ENABLE_MODULE_ATTRIBUTION
+// Maps return addresses to the modules that contain them. Modules in the
+// Windows directory (system DLLs, the DLL runtimes) are marked as system
+// modules so callers can skip them.
+// Modules are looked up by every allocating thread: the cache is read under a
+// shared lock, and the loader is only queried outside of the lock, as a thread
+// holding the loader lock may be allocating.
+class ModuleMap
+{
+  struct Module
+  {
+    HMODULE handle;
+    bool system;
+  };
+
+  static const uint32_t maxModules = 4096;
+
+  SRWLOCK lock = SRWLOCK_INIT;
+  Module modules[ maxModules ];
+  TCHAR( *names )[ MAX_PATH ] = nullptr; // kept for modules unloaded before the report
+  uint32_t moduleCount = 0;
+  PointerTable<uint16_t> cache; // return address -> module index
+  TCHAR windowsDirectory[ MAX_PATH ] = {};
+  size_t windowsDirectoryLength = 0;
+
+  // Called with the lock held. A module loaded where an unloaded one was gets its own index.
+  uint16_t AddModule( HMODULE handle, const TCHAR* path )
+  {
+    if ( !names )
+      names = (TCHAR( * )[ MAX_PATH ])VirtualAlloc( NULL, sizeof( TCHAR ) * MAX_PATH * maxModules, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+
+    for ( uint32_t x = 0; x < moduleCount; x++ )
+      if ( modules[ x ].handle == handle && ( !names || !_tcsicmp( names[ x ], path ) ) )
+        return (uint16_t)x;
+
+    if ( moduleCount == maxModules )
+      return unknownModule;
+
+    if ( !windowsDirectoryLength )
+      windowsDirectoryLength = GetSystemWindowsDirectory( windowsDirectory, MAX_PATH );
+
+    size_t length = _tcslen( path );
+    modules[ moduleCount ].handle = handle;
+    modules[ moduleCount ].system = windowsDirectoryLength && length > windowsDirectoryLength && !_tcsnicmp( path, windowsDirectory, windowsDirectoryLength );
+    if ( names )
+      _tcscpy_s( names[ moduleCount ], path );
+    return (uint16_t)moduleCount++;
+  }
+
+public:
+  static const uint16_t unknownModule = 0xffff;
+
+  uint16_t GetModule( void* address )
+  {
+    AcquireSRWLockShared( &lock );
+    auto entry = cache.Find( address );
+    uint16_t module = entry ? entry->value : unknownModule;
+    ReleaseSRWLockShared( &lock );
+    if ( entry )
+      return module;
+
+    HMODULE handle;
+    TCHAR path[ MAX_PATH ] = {};
+    bool found = GetModuleHandleEx( GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCTSTR)address, &handle ) != 0;
+    if ( found && !GetModuleFileName( handle, path, MAX_PATH ) )
+      path[ 0 ] = 0;
+
+    AcquireSRWLockExclusive( &lock );
+    if ( found )
+      module = AddModule( handle, path );
+    cache.InsertOrAssign( address, module );
+    ReleaseSRWLockExclusive( &lock );
+    return module;
+  }
+
+  // The first non-system module of a stack, or the first module if all are system modules
+  uint16_t GetOwner( const StackTracker& stack )
+  {
+    uint16_t first = unknownModule;
+    for ( int x = 0; x < STACK_TRACE_DEPTH; x++ )
+    {
+      void* frame = stack.GetFrames()[ x ];
+      if ( !frame )
+        continue;
+
+      uint16_t module = GetModule( frame );
+      if ( module == unknownModule )
+        continue;
+      if ( !modules[ module ].system )
+        return module;
+      if ( first == unknownModule )
+        first = module;
+    }
+    return first;
+  }
+
+  uint32_t GetModuleCount()
+  {
+    AcquireSRWLockShared( &lock );
+    uint32_t count = moduleCount;
+    ReleaseSRWLockShared( &lock );
+    return count;
+  }
+
+  // The name is the one the module had when first seen, the handle is
+  // printed if there's none
+  void GetModuleName( uint16_t module, TCHAR* name, size_t length )
+  {
+    if ( module == unknownModule )
+      _sntprintf_s( name, length, length - 1, _T( "<no module>\0" ) );
+    else if ( names && names[ module ][ 0 ] )
+      _sntprintf_s( name, length, length - 1, _T( "%s\0" ), names[ module ] );
+    else if ( !GetModuleFileName( modules[ module ].handle, name, (DWORD)length ) )
+      _sntprintf_s( name, length, length - 1, _T( "<unloaded module %p>\0" ), modules[ module ].handle );
+  }
+};
+#endif // ENABLE_MODULE_ATTRIBUTION
+
+#if ENABLE_HEATMAP || ENABLE_RESERVE_DETECTOR || ENABLE_CONTENT_ANALYSIS || ENABLE_STARTUP_PHASES || ENABLE_EPOCH_PROFILE || ENABLE_COROUTINE_ATTRIBUTION || ENABLE_EXCEPTION_TRACKING || ENABLE_PAGE_FAULT_SAMPLING || ENABLE_LOCALITY_REPORT
+// Open addressing table of analysis records keyed by a nonzero 64 bit key,
+// storage comes from VirtualAlloc as it's filled while the tracker is locked
+template<typename T>
+class RecordTable
+{
+  T* slots = nullptr;
+  size_t capacity = 0;
+  size_t count = 0;
+  size_t initialCapacity;
+
+  // Returns false if out of memory, the table keeps its current slots then
+  bool Grow()
+  {
+    size_t newCapacity = capacity ? capacity * 2 : initialCapacity;
+    T* newSlots = (T*)VirtualAlloc( NULL, newCapacity * sizeof( T ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    if ( !newSlots )
+      return false;
+
+    T* oldSlots = slots;
+    size_t oldCapacity = capacity;
+    slots = newSlots;
+    capacity = newCapacity;
+    count = 0;
+    for ( size_t x = 0; x < oldCapacity; x++ )
+      if ( oldSlots[ x ].key )
+        *Find( oldSlots[ x ].key, true ) = oldSlots[ x ];
+    if ( oldSlots )
+      VirtualFree( oldSlots, 0, MEM_RELEASE );
+    return true;
+  }
+
+public:
+
+  // The initial capacity is a power of two
+  explicit RecordTable( size_t initialCapacity = 4096 )
+    : initialCapacity( initialCapacity )
+  {
+  }
+
+  ~RecordTable()
+  {
+    if ( slots )
+      VirtualFree( slots, 0, MEM_RELEASE );
+  }
+
+  // Returns nullptr if the key isn't found, or when inserting if the table
+  // can't grow and is full. A table that can't grow is filled up to its
+  // last empty slot, which ends the probing.
+  T* Find( uint64_t key, bool insert )
+  {
+    if ( insert && ( count + 1 ) * 2 > capacity && !Grow() && count + 2 > capacity )
+      insert = false;
+    if ( !slots )
+      return nullptr;
+
+    size_t mask = capacity - 1;
+    for ( size_t x = ( key * 0x9e3779b97f4a7c15ull ) >> 20 & mask;; x = ( x + 1 ) & mask )
+    {
+      if ( slots[ x ].key == key )
+        return &slots[ x ];
+      if ( !slots[ x ].key )
+      {
+        if ( !insert )
+          return nullptr;
+        memset( (void*)&slots[ x ], 0, sizeof( T ) );
+        slots[ x ].key = key;
+        count++;
+        return &slots[ x ];
+      }
+    }
+  }
+
+  size_t Count() const
+  {
+    return count;
+  }
+
+  void Clear()
+  {
+    if ( slots )
+      memset( (void*)slots, 0, capacity * sizeof( T ) );
+    count = 0;
+  }
+
+  template<typename F>
+  void ForEach( F fn )
+  {
+    for ( size_t x = 0; x < capacity; x++ )
+      if ( slots[ x ].key )
+        fn( slots[ x ] );
+  }
+
+  // Calls fn( record ) for the count records that compare first, in that
+  // order, skipping the records include( record ) rejects
+  template<size_t count, typename Compare, typename F, typename Include>
+  void ForEachTopN( Compare compare, F fn, Include include )
+  {
+    // a heap with the last of the records kept on top
+    T* top[ count ];
+    size_t found = 0;
+    auto heapOrder = [ & ]( const T* a, const T* b ) { return compare( *a, *b ); };
+    ForEach( [ & ]( T& record )
+    {
+      if ( !include( record ) )
+        return;
+
+      if ( found < count )
+      {
+        top[ found++ ] = &record;
+        std::push_heap( top, top + found, heapOrder );
+      }
+      else if ( compare( record, *top[ 0 ] ) )
+      {
+        std::pop_heap( top, top + count, heapOrder );
+        top[ count - 1 ] = &record;
+        std::push_heap( top, top + count, heapOrder );
+      }
+    } );
+
+    std::sort_heap( top, top + found, heapOrder );
+    for ( size_t x = 0; x < found; x++ )
+      fn( *top[ x ] );
+  }
+
+  template<size_t count, typename Compare, typename F>
+  void ForEachTopN( Compare compare, F fn )
+  {
+    ForEachTopN<count>( compare, fn, []( const T& ) { return true; } );
+  }
+};
+
+// The part of the analyses' per call site records they all share
+struct SiteRecord
+{
+  uint64_t key; // site | 1 << 32, see GetKey()
+  bool hasInfo;
+  AllocationInfo info; // the first block recorded for the site, for its stack
+
+  static uint64_t GetKey( uint32_t site )
+  {
+    return site | 1ull << 32;
+  }
+
+  void SetInfo( const AllocationInfo& block )
+  {
+    if ( hasInfo )
+      return;
+
+    new ( &info ) AllocationInfo( block );
+    hasInfo = true;
+  }
+
+  void DumpStack()
+  {
+#ifdef ENABLE_STACK_TRACE
+    if ( hasInfo )
+      info.DumpStack();
+#endif // ENABLE_STACK_TRACE
+  }
+};
+
+// Finds or adds the record of the site a block was allocated at, nullptr if the table is full
+template<typename T>
+T* FindSite( RecordTable<T>& sites, const AllocationInfo& info )
+{
+  T* site = sites.Find( SiteRecord::GetKey( info.GetSite() ), true );
+  if ( site )
+    site->SetInfo( info );
+  return site;
+}
+#endif // ENABLE_HEATMAP || ENABLE_RESERVE_DETECTOR || ENABLE_CONTENT_ANALYSIS || ENABLE_STARTUP_PHASES || ENABLE_EPOCH_PROFILE || ENABLE_COROUTINE_ATTRIBUTION || ENABLE_EXCEPTION_TRACKING || ENABLE_PAGE_FAULT_SAMPLING || ENABLE_LOCALITY_REPORT
+
+#if ENABLE_RESERVE_DETECTOR
+class ReserveDetector
+{
+  struct Site : SiteRecord
+  {
+    uint64_t reallocations;
+    uint64_t copiedBytes;
+    size_t largestBlock;
+  };
+
+  Mutex lock;
+  RecordTable<Site> sites;
+
+public:
+
+  void OnAllocate( const AllocationInfo& info )
+  {
+    ThreadRecord* record = threadRegistry.GetCurrent();
+    if ( !record )
+      return;
+
+    record->lastAllocationSize = info.GetSize();
+    record->lastAllocationSite = info.GetSite();
+  }
+
+  // Called for frees issued by the thread that allocated the block
+  void OnFree( const AllocationInfo& info )
+  {
+    ThreadRecord* record = threadRegistry.GetCurrent();
+    if ( !record )
+      return;
+
+    size_t grownSize = record->lastAllocationSize;
+    record->lastAllocationSize = 0;
+
+    size_t size = info.GetSize();
+    if ( !size || grownSize * 10 < size * 14 || grownSize * 10 > size * 21 || record->lastAllocationSite != info.GetSite() )
+      return;
+
+    Lock cs( lock );
+    Site* site = FindSite( sites, info );
+    if ( !site )
+      return;
+
+    site->reallocations++;
+    site->copiedBytes += size;
+    site->largestBlock = std::max( site->largestBlock, grownSize );
+  }
+
+  void Report()
+  {
+    Lock cs( lock );
+    TCHAR buffer[ 1024 ];
+    bool first = true;
+    sites.ForEachTopN<RESERVE_REPORT_SITES>( []( const Site& a, const Site& b ) { return a.copiedBytes > b.copiedBytes; }, [ & ]( Site& site )
+    {
+      if ( first )
+        OutputDebugString( _T( "\n--- Containers growing without reserve() ---\n\n" ) );
+      first = false;
+
+      _sntprintf_s( buffer, 1023, _T( "%llu reallocations copied %llu bytes, growing up to %zu bytes\n\0" ), site.reallocations, site.copiedBytes, site.largestBlock );
+      OutputDebugString( buffer );
+      site.DumpStack();
+    }, []( const Site& site ) { return site.reallocations >= RESERVE_MIN_REALLOCATIONS; } );
+  }
+};
+#endif // ENABLE_RESERVE_DETECTOR
+
+#if ENABLE_CONTENT_ANALYSIS
+// A live block and the hash of its contents. Blocks are considered identical
+// when their site, size and 64 bit hash match.
+struct BlockContent
+{
+  const void* p;
+  size_t size;
+  uint64_t hash;
+  uint32_t site;
+  bool zero;
+
+  bool operator<( const BlockContent& other ) const
+  {
+    if ( site != other.site )
+      return site < other.site;
+    return size != other.size ? size < other.size : hash < other.hash;
+  }
+};
+
+// Hashes a block 16 bytes at a time and checks if it's all zero in the same pass
+void HashBlockContent( BlockContent& block )
+{
+  const unsigned char* data = (const unsigned char*)block.p;
+  uint64_t hash = 0x9e3779b97f4a7c15ull ^ block.size;
+  uint64_t bits = 0;
+  size_t x = 0;
+
+#ifdef POINTER_TABLE_SSE2
+  // 32x32 bit multiplies of each lane's halves as in xxh3, the accumulator is
+  // mixed into every step so the order of the chunks matters
+  const __m128i key = _mm_set_epi64x( 0x85ebca77c2b2ae63ll, 0x27d4eb2f165667c5ll );
+  __m128i accumulator = _mm_set_epi64x( 0x165667b19e3779f9ll, 0x61c8864e7a143579ll );
+  __m128i any = _mm_setzero_si128();
+  for ( ; x + 16 <= block.size; x += 16 )
+  {
+    __m128i chunk = _mm_loadu_si128( (const __m128i*)( data + x ) );
+    any = _mm_or_si128( any, chunk );
+    __m128i keyed = _mm_xor_si128( _mm_xor_si128( chunk, key ), accumulator );
+    __m128i product = _mm_mul_epu32( keyed, _mm_shuffle_epi32( keyed, _MM_SHUFFLE( 0, 3, 0, 1 ) ) );
+    accumulator = _mm_add_epi64( _mm_add_epi64( accumulator, _mm_shuffle_epi32( chunk, _MM_SHUFFLE( 1, 0, 3, 2 ) ) ), product );
+  }
+
+  uint64_t lanes[ 2 ];
+  _mm_storeu_si128( (__m128i*)lanes, accumulator );
+  hash = ( hash ^ lanes[ 0 ] ) * 0x100000001b3ull;
+  hash = ( hash ^ lanes[ 1 ] ) * 0x100000001b3ull;
+  _mm_storeu_si128( (__m128i*)lanes, any );
+  bits = lanes[ 0 ] | lanes[ 1 ];
+#else
+  for ( ; x + 8 <= block.size; x += 8 )
+  {
+    uint64_t chunk;
+    memcpy( &chunk, data + x, 8 );
+    bits |= chunk;
+    hash = ( hash ^ chunk ) * 0x100000001b3ull;
+  }
+#endif // POINTER_TABLE_SSE2
+
+  for ( ; x < block.size; x++ )
+  {
+    bits |= data[ x ];
+    hash = ( hash ^ data[ x ] ) * 0x100000001b3ull;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  block.hash = hash;
+  block.zero = !bits;
+}
+
+// Hashes a set of blocks on worker threads, which take them in batches
+class ContentHasher
+{
+  static const size_t batchSize = 64;
+
+  BlockContent* blocks;
+  size_t count;
+  std::atomic<size_t> next{ 0 };
+
+  static DWORD WINAPI ThreadProc( LPVOID param )
+  {
+    ( (ContentHasher*)param )->Run();
+    return 0;
+  }
+
+  void Run()
+  {
+    for ( ;; )
+    {
+      size_t begin = next.fetch_add( batchSize, std::memory_order_relaxed );
+      if ( begin >= count )
+        return;
+      for ( size_t x = begin; x < begin + batchSize && x < count; x++ )
+        HashBlockContent( blocks[ x ] );
+    }
+  }
+
+public:
+
+  ContentHasher( BlockContent* blocks, size_t count )
+    : blocks( blocks )
+    , count( count )
+  {
+  }
+
+  // The calling thread works along with the workers
+  void Hash()
+  {
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo( &systemInfo );
+    DWORD threadCount = CONTENT_ANALYSIS_THREADS ? CONTENT_ANALYSIS_THREADS : systemInfo.dwNumberOfProcessors;
+    threadCount = (DWORD)std::min<size_t>( std::min<DWORD>( threadCount, 64 ), ( count + batchSize - 1 ) / batchSize );
+
+    HANDLE threads[ 64 ];
+    DWORD started = 0;
+    while ( started + 1 < threadCount && ( threads[ started ] = CreateThread( NULL, 0, ThreadProc, this, 0, NULL ) ) != NULL )
+      started++;
+
+    Run();
+    for ( DWORD x = 0; x < started; x++ )
+    {
+      WaitForSingleObject( threads[ x ], INFINITE );
+      CloseHandle( threads[ x ] );
+    }
+  }
+};
+#endif // ENABLE_CONTENT_ANALYSIS
+
+#if ENABLE_HEATMAP
+class Heatmap
+{
+  static const uint64_t cellSpan = HEATMAP_REGION_SIZE / HEATMAP_REGION_COLUMNS;
+
+  // One pixel: cellSpan bytes of address space in one snapshot
+  struct Cell
+  {
+    uint64_t key; // address / cellSpan, the first 64 KB are never allocated
+    uint32_t bytes;
+    uint32_t site; // site with the most bytes in the cell, by majority vote
+    uint32_t siteBytes;
+  };
+
+  struct Snapshot
+  {
+    size_t cellCount;
+    Cell cells[ 1 ];
+  };
+
+  struct Site : SiteRecord
+  {
+    uint64_t pixels;
+  };
+
+  RecordTable<Cell> cells;
+  RecordTable<Site> sites;
+  Snapshot* snapshots[ HEATMAP_MAX_SNAPSHOTS ];
+  uint32_t snapshotCount = 0;
+
+  static void GetSiteColor( uint32_t site, unsigned char color[ 3 ] )
+  {
+    uint32_t hash = site * 0x9e3779b1u;
+    for ( int x = 0; x < 3; x++ )
+      color[ x ] = (unsigned char)( 64 + ( hash >> ( 8 * x + 8 ) ) % 192 );
+  }
+
+  bool WriteImage( HANDLE file )
+  {
+    // the address ranges that ever held an allocation, sorted
+    size_t regionCount = 0;
+    for ( uint32_t x = 0; x < snapshotCount; x++ )
+      regionCount += snapshots[ x ]->cellCount;
+    uint64_t* regions = (uint64_t*)VirtualAlloc( NULL, ( regionCount + 1 ) * sizeof( uint64_t ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    if ( !regions )
+      return false;
+
+    regionCount = 0;
+    for ( uint32_t x = 0; x < snapshotCount; x++ )
+      for ( size_t y = 0; y < snapshots[ x ]->cellCount; y++ )
+        regions[ regionCount++ ] = snapshots[ x ]->cells[ y ].key / HEATMAP_REGION_COLUMNS;
+    std::sort( regions, regions + regionCount );
+    regionCount = std::unique( regions, regions + regionCount ) - regions;
+
+    size_t width = ( regionCount ? regionCount : 1 ) * HEATMAP_REGION_COLUMNS;
+    unsigned char* row = (unsigned char*)VirtualAlloc( NULL, width * 3, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    if ( !row )
+    {
+      VirtualFree( regions, 0, MEM_RELEASE );
+      return false;
+    }
+
+    char header[ 64 ];
+    int headerLength = sprintf_s( header, "P6\n%zu %u\n255\n", width, snapshotCount );
+    DWORD written;
+    bool success = WriteFile( file, header, headerLength, &written, NULL ) != FALSE;
+
+    for ( uint32_t x = 0; x < snapshotCount && success; x++ )
+    {
+      memset( row, 0, width * 3 );
+      for ( size_t y = 0; y < snapshots[ x ]->cellCount; y++ )
+      {
+        Cell& cell = snapshots[ x ]->cells[ y ];
+        size_t region = std::lower_bound( regions, regions + regionCount, cell.key / HEATMAP_REGION_COLUMNS ) - regions;
+        unsigned char* pixel = row + ( region * HEATMAP_REGION_COLUMNS + cell.key % HEATMAP_REGION_COLUMNS ) * 3;
+
+        // sparse cells are kept visible
+        unsigned char color[ 3 ];
+        GetSiteColor( cell.site, color );
+        uint32_t density = 64 + 192 * std::min<uint64_t>( cell.bytes, cellSpan ) / cellSpan;
+        for ( int c = 0; c < 3; c++ )
+          pixel[ c ] = (unsigned char)( color[ c ] * density / 256 );
+      }
+      success = WriteFile( file, row, (DWORD)( width * 3 ), &written, NULL ) != FALSE;
+    }
+
+    VirtualFree( row, 0, MEM_RELEASE );
+    VirtualFree( regions, 0, MEM_RELEASE );
+    return success;
+  }
+
+  void DumpLegend()
+  {
+    TCHAR buffer[ 1024 ];
+    sites.ForEachTopN<HEATMAP_LEGEND_SITES>( []( const Site& a, const Site& b ) { return a.pixels > b.pixels; }, [ & ]( Site& site )
+    {
+      unsigned char color[ 3 ];
+      GetSiteColor( site.info.GetSite(), color );
+      _sntprintf_s( buffer, 1023, _T( "Heatmap site #%02x%02x%02x: %llu pixels\n\0" ), color[ 0 ], color[ 1 ], color[ 2 ], site.pixels );
+      OutputDebugString( buffer );
+      site.DumpStack();
+    } );
+  }
+
+public:
+
+  ~Heatmap()
+  {
+    for ( uint32_t x = 0; x < snapshotCount; x++ )
+      VirtualFree( snapshots[ x ], 0, MEM_RELEASE );
+  }
+
+  bool IsFull() const
+  {
+    return snapshotCount == HEATMAP_MAX_SNAPSHOTS;
+  }
+
+  void AddBlock( const void* p, const AllocationInfo& info )
+  {
+    uint32_t site = info.GetSite();
+    uint64_t begin = (uintptr_t)p;
+    uint64_t end = begin + std::max<size_t>( info.GetSize(), 1 );
+    for ( uint64_t key = begin / cellSpan; key * cellSpan < end; key++ )
+    {
+      Cell* cell = cells.Find( key, true );
+      if ( !cell )
+        return;
+
+      uint32_t bytes = (uint32_t)( std::min( end, ( key + 1 ) * cellSpan ) - std::max( begin, key * cellSpan ) );
+      cell->bytes += bytes;
+      if ( cell->site == site || !cell->siteBytes )
+      {
+        cell->site = site;
+        cell->siteBytes += bytes;
+      }
+      else if ( cell->siteBytes > bytes )
+        cell->siteBytes -= bytes;
+      else
+      {
+        cell->site = site;
+        cell->siteBytes = bytes - cell->siteBytes;
+      }
+    }
+
+    FindSite( sites, info );
+  }
+
+  // Stores the cells added since the last call as a new row
+  void EndSnapshot()
+  {
+    if ( IsFull() )
+      return;
+
+    Snapshot* snapshot = (Snapshot*)VirtualAlloc( NULL, sizeof( Snapshot ) + cells.Count() * sizeof( Cell ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    if ( snapshot )
+    {
+      snapshot->cellCount = 0;
+      cells.ForEach( [ & ]( Cell& cell )
+      {
+        snapshot->cells[ snapshot->cellCount++ ] = cell;
+        if ( Site* site = sites.Find( SiteRecord::GetKey( cell.site ), false ) )
+          site->pixels++;
+      } );
+      snapshots[ snapshotCount++ ] = snapshot;
+    }
+    cells.Clear();
+  }
+
+  void Write()
+  {
+    if ( !snapshotCount )
+      return;
+
+    HANDLE file = CreateFile( _T( HEATMAP_FILE ), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+    bool success = file != INVALID_HANDLE_VALUE && WriteImage( file );
+    if ( file != INVALID_HANDLE_VALUE )
+      CloseHandle( file );
+
+    if ( !success )
+    {
+      OutputDebugString( _T( "**** ERROR: Failed to write the heatmap\n" ) );
+      return;
+    }
+
+    TCHAR buffer[ 1024 ];
+    _sntprintf_s( buffer, 1023, _T( "Heatmap of %u snapshots written to %hs\n\0" ), snapshotCount, HEATMAP_FILE );
+    OutputDebugString( buffer );
+    DumpLegend();
+  }
+};
+#endif // ENABLE_HEATMAP
+
+#if ENABLE_STARTUP_PHASES
+// Totals are counted per thread and merged for the reports. Sites are only
+// gathered until steady state, where the profile stops taking its lock.
+class PhaseProfile
+{
+  struct Site : SiteRecord
+  {
+    uint64_t allocations;
+    uint64_t bytes;
+    uint64_t cycles;
+  };
+
+  struct Totals
+  {
+    uint64_t allocations;
+    uint64_t bytes;
+    uint64_t allocationCycles;
+    uint64_t frees;
+    uint64_t freeCycles;
+
+    void Merge( const PhaseTotals& other )
+    {
+      allocations += other.allocations.load( std::memory_order_relaxed );
+      bytes += other.bytes.load( std::memory_order_relaxed );
+      allocationCycles += other.allocationCycles.load( std::memory_order_relaxed );
+      frees += other.frees.load( std::memory_order_relaxed );
+      freeCycles += other.freeCycles.load( std::memory_order_relaxed );
+    }
+  };
+
+  Mutex lock;
+  std::atomic<int> phase{ 0 };
+  RecordTable<Site> sites[ (int)ProcessPhase::SteadyState ];
+  PhaseTotals unownedTotals[ (int)ProcessPhase::Count ] = {}; // threads without a record, under the lock
+  ULONGLONG phaseStart[ (int)ProcessPhase::Count ] = { GetTickCount64() };
+
+  static void Add( std::atomic<uint64_t>& counter, uint64_t value )
+  {
+    counter.store( counter.load( std::memory_order_relaxed ) + value, std::memory_order_relaxed );
+  }
+
+  static void AddAllocation( PhaseTotals& totals, size_t size, unsigned long long cycles )
+  {
+    Add( totals.allocations, 1 );
+    Add( totals.bytes, size );
+    Add( totals.allocationCycles, cycles );
+  }
+
+  void ReportPhase( int index, ULONGLONG now )
+  {
+    static const TCHAR* names[] = { _T( "Static initialization" ), _T( "Startup" ), _T( "Steady state" ) };
+
+    Totals total = {};
+    total.Merge( unownedTotals[ index ] );
+    threadRegistry.ForEach( [ & ]( ThreadRecord& record ) { total.Merge( record.phaseTotals[ index ] ); } );
+
+    ULONGLONG end = index < phase.load() ? phaseStart[ index + 1 ] : now;
+    TCHAR buffer[ 1024 ];
+    _sntprintf_s( buffer, 1023, _T( "\n%s: %llu ms, %llu allocations of %llu bytes in %llu kcycles, %llu frees in %llu kcycles\0" ),
+                  names[ index ], end - phaseStart[ index ], total.allocations, total.bytes, total.allocationCycles / 1000, total.frees, total.freeCycles / 1000 );
+    OutputDebugString( buffer );
+    if ( index == (int)ProcessPhase::SteadyState )
+    {
+      OutputDebugString( _T( "\n" ) );
+      return;
+    }
+
+    _sntprintf_s( buffer, 1023, _T( ", %zu sites\n\n\0" ), sites[ index ].Count() );
+    OutputDebugString( buffer );
+    sites[ index ].ForEachTopN<STARTUP_REPORT_SITES>( []( const Site& a, const Site& b ) { return a.cycles > b.cycles; }, [ & ]( Site& site )
+    {
+      _sntprintf_s( buffer, 1023, _T( "%llu kcycles in %llu allocations of %llu bytes\n\0" ), site.cycles / 1000, site.allocations, site.bytes );
+      OutputDebugString( buffer );
+      site.DumpStack();
+    } );
+  }
+
+public:
+
+  // Returns false if the process is in or past the phase already
+  bool Enter( ProcessPhase next )
+  {
+    Lock cs( lock );
+    int current = phase.load();
+    if ( current >= (int)next )
+      return false;
+
+    // skipped phases are left empty
+    for ( int x = current + 1; x <= (int)next; x++ )
+      phaseStart[ x ] = GetTickCount64();
+    phase.store( (int)next );
+    return true;
+  }
+
+  void RecordAllocation( const AllocationInfo& info, unsigned long long cycles )
+  {
+    int current = phase.load( std::memory_order_relaxed );
+    ThreadRecord* record = threadRegistry.GetCurrent();
+    if ( record && current == (int)ProcessPhase::SteadyState )
+    {
+      AddAllocation( record->phaseTotals[ current ], info.GetSize(), cycles );
+      return;
+    }
+
+    Lock cs( lock );
+    AddAllocation( record ? record->phaseTotals[ current ] : unownedTotals[ current ], info.GetSize(), cycles );
+    if ( current == (int)ProcessPhase::SteadyState )
+      return;
+
+    Site* site = FindSite( sites[ current ], info );
+    if ( !site )
+      return;
+
+    site->allocations++;
+    site->bytes += info.GetSize();
+    site->cycles += cycles;
+  }
+
+  void RecordFree( unsigned long long cycles )
+  {
+    int current = phase.load( std::memory_order_relaxed );
+    ThreadRecord* record = threadRegistry.GetCurrent();
+    if ( !record )
+    {
+      Lock cs( lock );
+      Add( unownedTotals[ current ].frees, 1 );
+      Add( unownedTotals[ current ].freeCycles, cycles );
+      return;
+    }
+
+    Add( record->phaseTotals[ current ].frees, 1 );
+    Add( record->phaseTotals[ current ].freeCycles, cycles );
+  }
+
+  // Reports the phases up to and including the last one
+  void Report( ProcessPhase last )
+  {
+    Lock cs( lock );
+    ULONGLONG now = GetTickCount64();
+    OutputDebugString( _T( "\n--- Allocations per process phase ---\n" ) );
+    for ( int x = 0; x <= (int)last && x <= phase.load(); x++ )
+      ReportPhase( x, now );
+    OutputDebugString( _T( "\n" ) );
+  }
+};
+#endif // ENABLE_STARTUP_PHASES
+
+#if ENABLE_EPOCH_PROFILE
+struct EpochSite : SiteRecord
+{
+  uint64_t allocations;
+  uint64_t bytes;
+};
+
+struct EpochTotals
+{
+  uint64_t allocations;
+  uint64_t bytes;
+  uint64_t frees;
+};
+
+// A thread's part of the current epoch. Its lock is only contended by the
+// fold at the end of the epoch.
+struct ThreadEpoch
+{
+  SRWLOCK lock = SRWLOCK_INIT;
+  EpochTotals totals = {};
+  RecordTable<EpochSite> sites{ 256 };
+};
+
+// Threads count their allocations and frees on their own, EndEpoch() folds
+// them into the epoch. Threads without a record count under the profile's lock.
+class EpochProfile
+{
+  struct WorstEpoch
+  {
+    uint64_t index;
+    EpochTotals totals;
+    int siteCount;
+    EpochSite sites[ EPOCH_REPORT_SITES ];
+  };
+
+  Mutex lock;
+  EpochTotals current = {};
+  RecordTable<EpochSite> sites;
+  EpochTotals* history = nullptr; // the finished epochs that fit in memory
+  size_t historyCapacity = 0;
+  size_t epochCount = 0; // in the history
+  uint64_t epochIndex = 0;
+  WorstEpoch* worst = nullptr; // sorted by allocations
+  int worstCount = 0;
+
+  static void AddAllocation( EpochTotals& totals, RecordTable<EpochSite>& sites, const AllocationInfo& info )
+  {
+    totals.allocations++;
+    totals.bytes += info.GetSize();
+
+    EpochSite* site = FindSite( sites, info );
+    if ( !site )
+      return;
+
+    site->allocations++;
+    site->bytes += info.GetSize();
+  }
+
+  // Returns nullptr for threads without a record or out of memory
+  static ThreadEpoch* GetThreadEpoch()
+  {
+    ThreadRecord* record = threadRegistry.GetCurrent();
+    if ( !record )
+      return nullptr;
+
+    ThreadEpoch* epoch = record->epoch.load( std::memory_order_relaxed );
+    if ( !epoch )
+    {
+      void* memory = VirtualAlloc( NULL, sizeof( ThreadEpoch ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+      if ( memory )
+      {
+        epoch = new ( memory ) ThreadEpoch();
+        record->epoch.store( epoch, std::memory_order_release );
+      }
+    }
+    return epoch;
+  }
+
+  void Fold( ThreadEpoch& epoch )
+  {
+    AcquireSRWLockExclusive( &epoch.lock );
+    current.allocations += epoch.totals.allocations;
+    current.bytes += epoch.totals.bytes;
+    current.frees += epoch.totals.frees;
+    epoch.totals = {};
+    if ( epoch.sites.Count() )
+    {
+      epoch.sites.ForEach( [ & ]( EpochSite& threadSite )
+      {
+        EpochSite* site = sites.Find( threadSite.key, true );
+        if ( !site )
+          return;
+
+        if ( !site->hasInfo )
+        {
+          site->hasInfo = threadSite.hasInfo;
+          site->info = threadSite.info;
+        }
+        site->allocations += threadSite.allocations;
+        site->bytes += threadSite.bytes;
+      } );
+      epoch.sites.Clear();
+    }
+    ReleaseSRWLockExclusive( &epoch.lock );
+  }
+
+  // Returns false if out of memory
+  bool AddToHistory()
+  {
+    if ( epochCount == historyCapacity )
+    {
+      size_t capacity = historyCapacity ? historyCapacity * 2 : 4096;
+      EpochTotals* grown = (EpochTotals*)VirtualAlloc( NULL, capacity * sizeof( EpochTotals ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+      if ( !grown )
+        return false;
+      if ( history )
+      {
+        memcpy( grown, history, epochCount * sizeof( EpochTotals ) );
+        VirtualFree( history, 0, MEM_RELEASE );
+      }
+      history = grown;
+      historyCapacity = capacity;
+    }
+    history[ epochCount++ ] = current;
+    return true;
+  }
+
+  void AddToWorst()
+  {
+    if ( !worst )
+      worst = (WorstEpoch*)VirtualAlloc( NULL, EPOCH_WORST_COUNT * sizeof( WorstEpoch ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    if ( !worst || !current.allocations )
+      return;
+    if ( worstCount == EPOCH_WORST_COUNT && current.allocations <= worst[ worstCount - 1 ].totals.allocations )
+      return;
+
+    WorstEpoch& epoch = worst[ worstCount < EPOCH_WORST_COUNT ? worstCount++ : worstCount - 1 ];
+    epoch.index = epochIndex;
+    epoch.totals = current;
+    epoch.siteCount = 0;
+    sites.ForEachTopN<EPOCH_REPORT_SITES>( []( const EpochSite& a, const EpochSite& b ) { return a.allocations > b.allocations; }, [ & ]( EpochSite& site ) { epoch.sites[ epoch.siteCount++ ] = site; } );
+
+    std::sort( worst, worst + worstCount, []( const WorstEpoch& a, const WorstEpoch& b ) { return a.totals.allocations > b.totals.allocations; } );
+  }
+
+  void ReportDistribution( const TCHAR* name, uint64_t EpochTotals::*field, uint64_t* values )
+  {
+    uint64_t sum = 0;
+    for ( size_t x = 0; x < epochCount; x++ )
+    {
+      values[ x ] = history[ x ].*field;
+      sum += values[ x ];
+    }
+    std::sort( values, values + epochCount );
+
+    TCHAR buffer[ 1024 ];
+    _sntprintf_s( buffer, 1023, _T( "%-12s mean %10.1f  p50 %10llu  p90 %10llu  p99 %10llu  max %10llu\n\0" ), name, (double)sum / epochCount,
+                  values[ epochCount / 2 ], values[ epochCount * 90 / 100 ], values[ epochCount * 99 / 100 ], values[ epochCount - 1 ] );
+    OutputDebugString( buffer );
+  }
+
+public:
+
+  ~EpochProfile()
+  {
+    if ( history )
+      VirtualFree( history, 0, MEM_RELEASE );
+    if ( worst )
+      VirtualFree( worst, 0, MEM_RELEASE );
+  }
+
+  void RecordAllocation( const AllocationInfo& info )
+  {
+    if ( ThreadEpoch* epoch = GetThreadEpoch() )
+    {
+      AcquireSRWLockExclusive( &epoch->lock );
+      AddAllocation( epoch->totals, epoch->sites, info );
+      ReleaseSRWLockExclusive( &epoch->lock );
+      return;
+    }
+
+    Lock cs( lock );
+    AddAllocation( current, sites, info );
+  }
+
+  void RecordFree()
+  {
+    if ( ThreadEpoch* epoch = GetThreadEpoch() )
+    {
+      AcquireSRWLockExclusive( &epoch->lock );
+      epoch->totals.frees++;
+      ReleaseSRWLockExclusive( &epoch->lock );
+      return;
+    }
+
+    Lock cs( lock );
+    current.frees++;
+  }
+
+  void EndEpoch()
+  {
+    Lock cs( lock );
+    threadRegistry.ForEach( [ & ]( ThreadRecord& record )
+    {
+      if ( ThreadEpoch* epoch = record.epoch.load( std::memory_order_acquire ) )
+        Fold( *epoch );
+    } );
+    AddToHistory();
+    AddToWorst();
+    epochIndex++;
+    current = {};
+    if ( sites.Count() )
+      sites.Clear();
+  }
+
+  void Report()
+  {
+    Lock cs( lock );
+    if ( !epochCount )
+      return;
+
+    uint64_t* values = (uint64_t*)VirtualAlloc( NULL, epochCount * sizeof( uint64_t ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    if ( !values )
+      return;
+
+    TCHAR buffer[ 1024 ];
+    _sntprintf_s( buffer, 1023, _T( "\n--- Allocations per epoch ---\n\n%llu epochs\n\0" ), epochIndex );
+    OutputDebugString( buffer );
+    if ( epochCount < epochIndex )
+    {
+      _sntprintf_s( buffer, 1023, _T( "**** WARNING: Out of memory for the epoch history, the distribution only covers %zu epochs\n\0" ), epochCount );
+      OutputDebugString( buffer );
+    }
+    ReportDistribution( _T( "allocations" ), &EpochTotals::allocations, values );
+    ReportDistribution( _T( "bytes" ), &EpochTotals::bytes, values );
+    ReportDistribution( _T( "frees" ), &EpochTotals::frees, values );
+    VirtualFree( values, 0, MEM_RELEASE );
+
+    for ( int x = 0; x < worstCount; x++ )
+    {
+      WorstEpoch& epoch = worst[ x ];
+      _sntprintf_s( buffer, 1023, _T( "\nEpoch %llu: %llu allocations of %llu bytes, %llu frees\n\0" ), epoch.index, epoch.totals.allocations, epoch.totals.bytes, epoch.totals.frees );
+      OutputDebugString( buffer );
+      for ( int y = 0; y < epoch.siteCount; y++ )
+      {
+        _sntprintf_s( buffer, 1023, _T( "%llu allocations of %llu bytes\n\0" ), epoch.sites[ y ].allocations, epoch.sites[ y ].bytes );
+        OutputDebugString( buffer );
+        epoch.sites[ y ].DumpStack();
+      }
+    }
+    OutputDebugString( _T( "\n" ) );
+  }
+};
+#endif // ENABLE_EPOCH_PROFILE
+
+#if ENABLE_COROUTINE_ATTRIBUTION
+// Precedes every frame allocated by LeakTracker::AllocateCoroutineFrame(), so
+// the frame's coroutine is known when it's freed
+struct CoroutineFrameHeader
+{
+  const void* coroutine; // an address inside the coroutine
+  size_t size;
+};
+
+static const size_t coroutineFrameHeaderSize = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+// Set by LeakTracker::AllocateCoroutineFrame() around the frame allocation
+thread_local const CoroutineFrameHeader* allocatingCoroutineFrame = nullptr;
+
+class CoroutineProfile
+{
+  // keyed by the coroutine's address
+  struct Site : SiteRecord
+  {
+    uint64_t frames;
+    uint64_t bytes;
+    size_t largestFrame;
+    uint64_t liveFrames;
+    uint64_t liveBytes;
+    uint64_t peakLiveBytes;
+  };
+
+  Mutex lock;
+  RecordTable<Site> sites;
+
+  static void GetCoroutineName( const void* coroutine, char* name, size_t length )
+  {
+#ifdef ENABLE_STACK_TRACE
+    // MSVC's coroutine helpers ($_InitCoro$, $_ResumeCoro$) are named after the coroutine
+    void* frames[ STACK_TRACE_DEPTH ] = { (void*)coroutine };
+    if ( StackTracker( frames ).GetFunctionName( 0, name, length ) )
+    {
+      if ( char* helper = strchr( name, '$' ) )
+        *helper = 0;
+      return;
+    }
+#endif // ENABLE_STACK_TRACE
+    _snprintf_s( name, length, _TRUNCATE, "<coroutine at %p>", coroutine );
+  }
+
+public:
+
+  void RecordFrame( const CoroutineFrameHeader& frame, const AllocationInfo& info )
+  {
+    Lock cs( lock );
+    Site* site = sites.Find( (uint64_t)frame.coroutine, true );
+    if ( !site )
+      return;
+
+    site->SetInfo( info );
+    site->frames++;
+    site->bytes += frame.size;
+    site->largestFrame = std::max( site->largestFrame, frame.size );
+    site->liveFrames++;
+    site->liveBytes += frame.size;
+    site->peakLiveBytes = std::max( site->peakLiveBytes, site->liveBytes );
+  }
+
+  void RecordFree( const CoroutineFrameHeader& frame )
+  {
+    Lock cs( lock );
+    Site* site = sites.Find( (uint64_t)frame.coroutine, false );
+    if ( !site || !site->liveFrames ) // allocated while the tracker was paused
+      return;
+
+    site->liveFrames--;
+    site->liveBytes -= std::min<uint64_t>( frame.size, site->liveBytes );
+  }
+
+  void Report()
+  {
+    Lock cs( lock );
+    TCHAR buffer[ 1024 ];
+    char name[ 512 ];
+    bool first = true;
+    sites.ForEachTopN<COROUTINE_REPORT_SITES>( []( const Site& a, const Site& b ) { return a.bytes > b.bytes; }, [ & ]( Site& site )
+    {
+      if ( first )
+        OutputDebugString( _T( "\n--- Coroutine frames ---\n\n" ) );
+      first = false;
+
+      GetCoroutineName( (const void*)site.key, name, sizeof( name ) );
+      _sntprintf_s( buffer, 1023, _T( "%10llu frames of %12llu bytes, largest %8zu bytes, peak %12llu bytes live, %6llu live now  %hs\n\0" ),
+                    site.frames, site.bytes, site.largestFrame, site.peakLiveBytes, site.liveFrames, name );
+      OutputDebugString( buffer );
+      site.DumpStack();
+    } );
+  }
+};
+#endif // ENABLE_COROUTINE_ATTRIBUTION
+
+#if ENABLE_EXCEPTION_TRACKING
+// Counts C++ throws from a vectored exception handler. The layouts below are
+// the parts of the MSVC throw information the handler reads, offsets are
+// relative to the image base on x64 and plain pointers on x86.
+class ExceptionTracker
+{
+  static const DWORD cppExceptionCode = 0xe06d7363;
+
+  struct ThrowInfo
+  {
+    uint32_t attributes;
+    int32_t unwind;
+    int32_t forwardCompat;
+    int32_t catchableTypeArray;
+  };
+
+  struct CatchableTypeArray
+  {
+    int32_t count;
+    int32_t types[ 1 ];
+  };
+
+  struct CatchableType
+  {
+    uint32_t properties;
+    int32_t typeDescriptor;
+    int32_t displacement[ 3 ];
+    int32_t size;
+    int32_t copyFunction;
+  };
+
+  struct TypeDescriptor
+  {
+    const void* vftable;
+    void* spare;
+    char name[ 1 ]; // decorated
+  };
+
+  struct Type
+  {
+    uint64_t key; // type descriptor address
+    uint64_t throws;
+    uint64_t bytes;
+    char name[ 128 ];
+  };
+
+  // keyed by a hash of the site and the type
+  struct Site : SiteRecord
+  {
+    uint64_t throws;
+    uint64_t bytes;
+    uint64_t type;
+  };
+
+  Mutex lock;
+  RecordTable<Type> types;
+  RecordTable<Site> sites;
+  PVOID handler;
+
+  static LONG NTAPI ExceptionHandler( PEXCEPTION_POINTERS exception );
+
+  void OnThrow( PEXCEPTION_RECORD record )
+  {
+    uintptr_t base = record->NumberParameters >= 4 ? record->ExceptionInformation[ 3 ] : 0;
+    const ThrowInfo* throwInfo = (const ThrowInfo*)record->ExceptionInformation[ 2 ];
+    if ( !throwInfo || !throwInfo->catchableTypeArray )
+      return;
+
+    // the first catchable type is the thrown type itself
+    const CatchableTypeArray* catchable = (const CatchableTypeArray*)( base + throwInfo->catchableTypeArray );
+    if ( catchable->count < 1 )
+      return;
+    const CatchableType* thrown = (const CatchableType*)( base + catchable->types[ 0 ] );
+    const TypeDescriptor* descriptor = (const TypeDescriptor*)( base + thrown->typeDescriptor );
+
+    // skip to the frame above RaiseException, the throw site follows _CxxThrowException
+    void* frames[ STACK_TRACE_DEPTH + 32 ] = {};
+    USHORT frameCount = RtlCaptureStackBackTrace( 0, STACK_TRACE_DEPTH + 32, frames, NULL );
+    USHORT first = 0;
+    while ( first < frameCount && first < 32 && frames[ first ] != record->ExceptionAddress )
+      first++;
+    first = first < frameCount && first < 32 ? first + 1 : 0;
+
+#ifdef ENABLE_STACK_TRACE
+    AllocationInfo info( thrown->size, frames + first );
+#else
+    AllocationInfo info( thrown->size, nullptr );
+#endif // ENABLE_STACK_TRACE
+
+    Lock cs( lock );
+    if ( Type* type = types.Find( (uint64_t)descriptor, true ) )
+    {
+      if ( !type->throws )
+        strncpy_s( type->name, sizeof( type->name ), descriptor->name, _TRUNCATE );
+      type->throws++;
+      type->bytes += thrown->size;
+    }
+
+    if ( Site* site = sites.Find( ( (uint64_t)descriptor * 0x9e3779b97f4a7c15ull ^ info.GetSite() ) | 1, true ) )
+    {
+      site->throws++;
+      site->bytes += thrown->size;
+      site->type = (uint64_t)descriptor;
+      site->SetInfo( info );
+    }
+  }
+
+  const char* GetTypeName( uint64_t key, char* name, size_t length )
+  {
+    Type* type = types.Find( key, false );
+    if ( !type )
+      return "?";
+#ifdef ENABLE_STACK_TRACE
+    // type descriptor names are decorated type names with a leading '.'
+    if ( UnDecorateSymbolName( type->name + 1, name, (DWORD)length, UNDNAME_32_BIT_DECODE | UNDNAME_TYPE_ONLY ) )
+      return name;
+#endif // ENABLE_STACK_TRACE
+    return type->name;
+  }
+
+public:
+
+  ExceptionTracker()
+  {
+    handler = AddVectoredExceptionHandler( 1, ExceptionHandler );
+  }
+
+  ~ExceptionTracker()
+  {
+    if ( handler )
+      RemoveVectoredExceptionHandler( handler );
+  }
+
+  void Report()
+  {
+    Lock cs( lock );
+    if ( !types.Count() )
+      return;
+
+    TCHAR buffer[ 1024 ];
+    char name[ 512 ];
+    OutputDebugString( _T( "\n--- C++ exceptions per type ---\n\n" ) );
+    types.ForEach( [ & ]( Type& type )
+    {
+      _sntprintf_s( buffer, 1023, _T( "%10llu throws of %12llu bytes  %hs\n\0" ), type.throws, type.bytes, GetTypeName( type.key, name, sizeof( name ) ) );
+      OutputDebugString( buffer );
+    } );
+
+    OutputDebugString( _T( "\n--- C++ exceptions per throw site ---\n\n" ) );
+    sites.ForEachTopN<EXCEPTION_REPORT_SITES>( []( const Site& a, const Site& b ) { return a.throws > b.throws; }, [ & ]( Site& site )
+    {
+      _sntprintf_s( buffer, 1023, _T( "%llu throws of %llu bytes  %hs\n\0" ), site.throws, site.bytes, GetTypeName( site.type, name, sizeof( name ) ) );
+      OutputDebugString( buffer );
+      site.DumpStack();
+    } );
+  }
+};
+
+extern ExceptionTracker exceptionTracker;
+
+LONG NTAPI ExceptionTracker::ExceptionHandler( PEXCEPTION_POINTERS exception )
+{
+  PEXCEPTION_RECORD record = exception->ExceptionRecord;
+  if ( record->ExceptionCode == cppExceptionCode && record->NumberParameters >= 3 && ( record->ExceptionInformation[ 0 ] & ~3 ) == 0x19930520 )
+    exceptionTracker.OnThrow( record );
+  return EXCEPTION_CONTINUE_SEARCH;
+}
+#endif // ENABLE_EXCEPTION_TRACKING
+
+#if ENABLE_PAGE_FAULT_SAMPLING
+// Pages of a fresh block that aren't in the working set yet are faulted in
+// on first touch, QueryWorkingSetEx tells them apart without touching them.
+// Blocks are sampled as the allocator returns them, before the tracker writes
+// their header and canaries, and attributed to their site once it's known.
+class PageFaultProfile
+{
+  struct Site : SiteRecord
+  {
+    uint64_t samples;
+    uint64_t bytes;
+    uint64_t pages;
+    uint64_t missingPages;
+  };
+
+  // the thread's last sampled block, until the tracker records it
+  struct Sample
+  {
+    uintptr_t block;
+    size_t size;
+    size_t pages;
+    size_t missingPages;
+  };
+
+  Mutex lock;
+  RecordTable<Site> sites;
+
+  static size_t pageSize;
+  static thread_local int sampleCountdown;
+  static thread_local Sample pending;
+
+public:
+
+  static void SampleBlock( const void* block, size_t size )
+  {
+    if ( size < PAGE_FAULT_MIN_SIZE || --sampleCountdown > 0 )
+      return;
+    sampleCountdown = PAGE_FAULT_SAMPLE_RATE;
+
+    if ( !pageSize )
+    {
+      SYSTEM_INFO systemInfo;
+      GetSystemInfo( &systemInfo );
+      pageSize = systemInfo.dwPageSize;
+    }
+
+    // large blocks are checked at PAGE_FAULT_CHECKED_PAGES evenly spaced pages
+    uintptr_t first = (uintptr_t)block & ~( pageSize - 1 );
+    size_t pageCount = ( ( (uintptr_t)block + size - 1 ) & ~( pageSize - 1 ) ) / pageSize - first / pageSize + 1;
+    size_t checked = std::min( pageCount, (size_t)PAGE_FAULT_CHECKED_PAGES );
+    PSAPI_WORKING_SET_EX_INFORMATION pages[ PAGE_FAULT_CHECKED_PAGES ];
+    for ( size_t x = 0; x < checked; x++ )
+      pages[ x ].VirtualAddress = (PVOID)( first + pageCount * x / checked * pageSize );
+    if ( !QueryWorkingSetEx( GetCurrentProcess(), pages, (DWORD)( checked * sizeof( pages[ 0 ] ) ) ) )
+      return;
+
+    size_t missing = 0;
+    for ( size_t x = 0; x < checked; x++ )
+      missing += !pages[ x ].VirtualAttributes.Valid;
+    pending = Sample{ (uintptr_t)block, size, pageCount, missing * pageCount / checked };
+  }
+
+  void OnAllocate( const void* p, size_t size, const AllocationInfo& info )
+  {
+    Sample sample = pending;
+    pending = {};
+    if ( !sample.pages || (uintptr_t)p < sample.block || (uintptr_t)p >= sample.block + sample.size )
+      return;
+
+    Lock cs( lock );
+    Site* site = FindSite( sites, info );
+    if ( !site )
+      return;
+
+    site->samples++;
+    site->bytes += size;
+    site->pages += sample.pages;
+    site->missingPages += sample.missingPages;
+  }
+
+  void Report()
+  {
+    Lock cs( lock );
+    TCHAR buffer[ 1024 ];
+    bool first = true;
+    sites.ForEachTopN<PAGE_FAULT_REPORT_SITES>( []( const Site& a, const Site& b ) { return a.missingPages > b.missingPages; }, [ & ]( Site& site )
+    {
+      if ( first )
+        OutputDebugString( _T( "\n--- First touch page faults of fresh blocks (estimated from samples) ---\n\n" ) );
+      first = false;
+
+      _sntprintf_s( buffer, 1023, _T( "~%llu faults: %llu of %llu pages not resident in %llu sampled blocks of %llu bytes\n\0" ),
+                    site.missingPages * PAGE_FAULT_SAMPLE_RATE, site.missingPages, site.pages, site.samples, site.bytes );
+      OutputDebugString( buffer );
+      site.DumpStack();
+    }, []( const Site& site ) { return site.missingPages != 0; } );
+  }
+};
+
+size_t PageFaultProfile::pageSize = 0;
+thread_local int PageFaultProfile::sampleCountdown = 0;
+thread_local PageFaultProfile::Sample PageFaultProfile::pending = {};
+#endif // ENABLE_PAGE_FAULT_SAMPLING
+
+#if ENABLE_LOCALITY_REPORT
+struct DistanceSite
+{
+  uint64_t key; // site | 1 << 32
+  uintptr_t lastAddress;
+  uint64_t pairs;
+  double logDistanceSum;
+};
+
+// A thread's distances, its lock is only contended by reports
+struct ThreadDistances
+{
+  SRWLOCK lock = SRWLOCK_INIT;
+  RecordTable<DistanceSite> sites{ 256 };
+};
+
+// Distance between consecutive allocations of each call site on a thread. The
+// geometric mean keeps the occasional block from a distant region (a fresh
+// heap segment, a guarded sample) from dominating it. Threads measure on their
+// own, the threads' sums are merged when a site's mean is asked for.
+class AllocationDistances
+{
+  Mutex lock;
+  RecordTable<DistanceSite> sites; // threads without a record, under the lock
+
+  static void Add( RecordTable<DistanceSite>& sites, const void* p, const AllocationInfo& info )
+  {
+    DistanceSite* site = sites.Find( SiteRecord::GetKey( info.GetSite() ), true );
+    if ( !site )
+      return;
+
+    uintptr_t address = (uintptr_t)p;
+    if ( site->lastAddress )
+    {
+      site->pairs++;
+      site->logDistanceSum += log2( 1.0 + ( address > site->lastAddress ? address - site->lastAddress : site->lastAddress - address ) );
+    }
+    site->lastAddress = address;
+  }
+
+  // Returns nullptr for threads without a record or out of memory
+  static ThreadDistances* GetThreadDistances()
+  {
+    ThreadRecord* record = threadRegistry.GetCurrent();
+    if ( !record )
+      return nullptr;
+
+    ThreadDistances* distances = record->distances.load( std::memory_order_relaxed );
+    if ( !distances )
+    {
+      void* memory = VirtualAlloc( NULL, sizeof( ThreadDistances ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+      if ( memory )
+      {
+        distances = new ( memory ) ThreadDistances();
+        record->distances.store( distances, std::memory_order_release );
+      }
+    }
+    return distances;
+  }
+
+public:
+
+  void OnAllocate( const void* p, const AllocationInfo& info )
+  {
+    if ( ThreadDistances* distances = GetThreadDistances() )
+    {
+      AcquireSRWLockExclusive( &distances->lock );
+      Add( distances->sites, p, info );
+      ReleaseSRWLockExclusive( &distances->lock );
+      return;
+    }
+
+    Lock cs( lock );
+    Add( sites, p, info );
+  }
+
+  // Returns a negative value for sites with fewer than two allocations on a thread
+  double GetMeanDistance( uint32_t siteId )
+  {
+    uint64_t key = SiteRecord::GetKey( siteId );
+    uint64_t pairs = 0;
+    double logDistanceSum = 0;
+    auto merge = [ & ]( RecordTable<DistanceSite>& table )
+    {
+      if ( DistanceSite* site = table.Find( key, false ) )
+      {
+        pairs += site->pairs;
+        logDistanceSum += site->logDistanceSum;
+      }
+    };
+
+    Lock cs( lock );
+    merge( sites );
+    threadRegistry.ForEach( [ & ]( ThreadRecord& record )
+    {
+      ThreadDistances* distances = record.distances.load( std::memory_order_acquire );
+      if ( !distances )
+        return;
+
+      AcquireSRWLockExclusive( &distances->lock );
+      merge( distances->sites );
+      ReleaseSRWLockExclusive( &distances->lock );
+    } );
+    return pairs ? exp2( logDistanceSum / pairs ) - 1 : -1;
+  }
+};
+#endif // ENABLE_LOCALITY_REPORT
+
+class MemTracker
+{
+  Mutex critsec;
+  std::atomic<bool> paused{ true }; // this needs to be above the memTrackerPool variable (init order)
+  static thread_local bool updatingTable; // the tracker's own allocations while it updates a table aren't tracked
+
+  // Only the thread updating a table skips its allocations, other threads keep being tracked
+  bool IsTracking() const
+  {
+    return !updatingTable && !paused.load( std::memory_order_acquire );
+  }
+#if ENABLE_EVENT_RINGS
+  EventRingWriter eventRings;
+#endif // ENABLE_EVENT_RINGS
+#if ENABLE_EVENT_TRACE
+  EventTraceWriter eventTrace;
+#endif // ENABLE_EVENT_TRACE
+#if !ENABLE_PER_THREAD_TABLES
+  PointerTable<AllocationInfo> memTrackerPool;
+#endif // !ENABLE_PER_THREAD_TABLES
+
+#if ENABLE_CONTENT_ANALYSIS
+  // Blocks freed while a content analysis pass hashes without the lock are
+  // kept until it's done, so the pass never reads released memory
+  struct HeldBlock
+  {
+    uint64_t key; // the block's address
+  };
+
+  Mutex contentAnalysisLock;
+  Mutex heldBlocksLock;
+  std::atomic<bool> holdingFrees{ false };
+  RecordTable<HeldBlock> heldBlocks;
+
+  void ReleaseHeldBlocks()
+  {
+    Lock cs( heldBlocksLock );
+    holdingFrees.store( false );
+    heldBlocks.ForEach( []( HeldBlock& block ) { ReleaseBlockMemory( (void*)block.key ); } );
+    heldBlocks.Clear();
+  }
+#endif // ENABLE_CONTENT_ANALYSIS
+
+  // Removes a pointer from a table, reporting damaged canaries and unknown pointers
+  void EraseEntry( PointerTable<AllocationInfo>& table, void* p, bool remoteFree = false )
+  {
+    auto entry = table.Find( p );
+    if ( entry )
+    {
+#if ENABLE_HEAP_CANARIES
+      CheckCanaries( p, entry->value );
+#endif // ENABLE_HEAP_CANARIES
+#if ENABLE_RESERVE_DETECTOR
+      if ( !remoteFree )
+        reserveDetector.OnFree( entry->value );
+#endif // ENABLE_RESERVE_DETECTOR
+      table.Erase( entry );
+    }
+    else
+    {
+      OutputDebugString( _T( "**** ERROR: Trying to delete non logged, possibly already freed memory block!\n" ) );
+#ifdef ENABLE_STACK_TRACE
+      StackTracker s;
+      s.DumpToDebugOutput();
+#endif // ENABLE_STACK_TRACKER
+    }
+  }
+
+#if ENABLE_PER_THREAD_TABLES
+  // Owns the blocks allocated by threads without a record, like thread exit
+  // code running after the thread's record was released. Its table is only
+  // touched under critsec.
+  std::atomic<ThreadRecord*> sharedRecord{ nullptr };
+
+  OwnedTable* GetOwnedTable( ThreadRecord* record )
+  {
+    OwnedTable* owned = record->ownedTable.load( std::memory_order_relaxed );
+    if ( !owned )
+    {
+      void* memory = VirtualAlloc( NULL, sizeof( OwnedTable ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+      if ( memory )
+      {
+        owned = new ( memory ) OwnedTable();
+        record->ownedTable.store( owned, std::memory_order_release );
+      }
+    }
+    return owned;
+  }
+
+  // Applies the frees other threads queued for a table, called by whoever holds the table
+  void ApplyRemoteFrees( OwnedTable& owned )
+  {
+    if ( !owned.remoteFrees.load( std::memory_order_relaxed ) )
+      return;
+
+    void* p = owned.remoteFrees.exchange( nullptr, std::memory_order_acquire );
+    owned.queuedRemoteFrees.store( 0, std::memory_order_relaxed );
+    while ( p )
+    {
+      void* next = *GetRemoteFreeLink( p );
+      EraseEntry( owned.table, p, true );
+#if ENABLE_CONTENT_ANALYSIS
+      if ( !HoldFreedBlock( p ) )
+#endif // ENABLE_CONTENT_ANALYSIS
+        ReleaseBlockMemory( p );
+      p = next;
+    }
+  }
+
+  void AddSharedPointer( void* p, const AllocationInfo& info )
+  {
+    Lock cs( critsec );
+    ThreadRecord* record = sharedRecord.load( std::memory_order_relaxed );
+    if ( !record )
+    {
+      record = threadRegistry.AcquireUnowned();
+      if ( !record )
+        return;
+      sharedRecord.store( record, std::memory_order_release );
+    }
+
+    OwnedTable* owned = GetOwnedTable( record );
+    if ( !owned )
+      return;
+
+    owned->table.InsertOrAssign( p, info );
+    GetBlockOwner( p ) = record;
+  }
+
+  // Applies the queued frees of a table whose owner exited or doesn't get to them
+  void DrainRemoteFrees( OwnedTable& owned )
+  {
+    Lock cs( critsec );
+    owned.BeginInspection();
+    ApplyRemoteFrees( owned );
+    owned.EndInspection();
+  }
+#endif // ENABLE_PER_THREAD_TABLES
+
+  // Calls fn( table ) for every allocation table. Blocks in the table are
+  // neither added nor released while fn runs.
+  template<typename F>
+  void ForEachTable( F fn )
+  {
+    Lock cs( critsec );
+#if ENABLE_PER_THREAD_TABLES
+    threadRegistry.ForEach( [ & ]( ThreadRecord& record )
+    {
+      OwnedTable* owned = record.ownedTable.load( std::memory_order_acquire );
+      if ( !owned )
+        return;
+
+      owned->BeginInspection();
+      ApplyRemoteFrees( *owned );
+      fn( owned->table );
+      owned->EndInspection();
+    } );
+#else
+    fn( memTrackerPool );
+#endif // ENABLE_PER_THREAD_TABLES
+  }
+
+  // Calls fn( pointer, info ) for every tracked allocation
+  template<typename F>
+  void ForEachAllocation( F fn )
+  {
+    ForEachTable( [ & ]( PointerTable<AllocationInfo>& table )
+    {
+      table.ForEach( [ & ]( PointerTable<AllocationInfo>::Entry& entry ) { fn( entry.GetKey(), entry.value ); } );
+    } );
+  }
+
+#if ENABLE_MODULE_ATTRIBUTION
+  ModuleMap moduleMap;
+#endif // ENABLE_MODULE_ATTRIBUTION
+
+#if ENABLE_RESERVE_DETECTOR
+  ReserveDetector reserveDetector;
+#endif // ENABLE_RESERVE_DETECTOR
+
+#if ENABLE_STARTUP_PHASES
+  PhaseProfile phaseProfile;
+#endif // ENABLE_STARTUP_PHASES
+
+#if ENABLE_EPOCH_PROFILE
+  EpochProfile epochProfile;
+#endif // ENABLE_EPOCH_PROFILE
+
+#if ENABLE_COROUTINE_ATTRIBUTION
+  CoroutineProfile coroutineProfile;
+#endif // ENABLE_COROUTINE_ATTRIBUTION
+
+#if ENABLE_PAGE_FAULT_SAMPLING
+  PageFaultProfile pageFaultProfile;
+#endif // ENABLE_PAGE_FAULT_SAMPLING
+
+#if ENABLE_LOCALITY_REPORT
+  AllocationDistances allocationDistances;
+#endif // ENABLE_LOCALITY_REPORT
+
+#if ENABLE_HEATMAP
+  Heatmap heatmap;
+  HANDLE heatmapThread = NULL;
+  HANDLE heatmapThreadStop = NULL;
+  size_t heatmapSlot = 0;
+  size_t heatmapRecord = 0;
+
+  static DWORD WINAPI HeatmapThreadProc( LPVOID param )
+  {
+    MemTracker* tracker = (MemTracker*)param;
+    while ( WaitForSingleObject( tracker->heatmapThreadStop, HEATMAP_SNAPSHOT_MS ) == WAIT_TIMEOUT && !tracker->heatmap.IsFull() )
+      tracker->TakeHeatmapSnapshot();
+    return 0;
+  }
+
+  // Adds the blocks in at most maxSlots slots of a table to the heatmap,
+  // continuing where the previous call left off. Returns true once every
+  // table was walked.
+  bool AddHeatmapBlocks( size_t maxSlots )
+  {
+    Lock cs( critsec );
+    bool tableDone = true;
+    auto addBlocks = [ & ]( PointerTable<AllocationInfo>& table )
+    {
+      size_t end = std::min( heatmapSlot + maxSlots, table.Capacity() );
+      for ( ; heatmapSlot < end; heatmapSlot++ )
+        if ( auto entry = table.GetSlot( heatmapSlot ) )
+          heatmap.AddBlock( entry->GetKey(), entry->value );
+      tableDone = heatmapSlot >= table.Capacity();
+    };
+
+#if ENABLE_PER_THREAD_TABLES
+    size_t index = 0;
+    threadRegistry.ForEach( [ & ]( ThreadRecord& record )
+    {
+      OwnedTable* owned = record.ownedTable.load( std::memory_order_acquire );
+      if ( index++ != heatmapRecord || !owned )
+        return;
+
+      owned->BeginInspection();
+      addBlocks( owned->table );
+      owned->EndInspection();
+    } );
+    if ( !tableDone )
+      return false;
+
+    heatmapSlot = 0;
+    heatmapRecord = heatmapRecord + 1 < index ? heatmapRecord + 1 : 0;
+    return !heatmapRecord;
+#else
+    addBlocks( memTrackerPool );
+    if ( !tableDone )
+      return false;
+
+    heatmapSlot = 0;
+    return true;
+#endif // ENABLE_PER_THREAD_TABLES
+  }
+
+  // The lock is released between steps, so blocks moving in the table
+  // meanwhile may be missed or counted twice by a snapshot
+  void TakeHeatmapSnapshot()
+  {
+    for ( ;; )
+    {
+      if ( paused || WaitForSingleObject( heatmapThreadStop, 0 ) != WAIT_TIMEOUT )
+        return;
+      if ( AddHeatmapBlocks( HEATMAP_SLOTS_PER_STEP ) )
+        break;
+      SwitchToThread(); // lets the threads waiting for the lock in
+    }
+    heatmap.EndSnapshot();
+  }
+#endif // ENABLE_HEATMAP
+
+#if ENABLE_HEAP_CANARIES
+  HANDLE canaryThread = NULL;
+  HANDLE canaryThreadStop = NULL;
+  size_t canarySlot = 0;
+  size_t canaryRecord = 0;
+
+  static DWORD WINAPI CanaryThreadProc( LPVOID param )
+  {
+    MemTracker* tracker = (MemTracker*)param;
+    while ( WaitForSingleObject( tracker->canaryThreadStop, HEAP_CANARY_TICK_MS ) == WAIT_TIMEOUT )
+      tracker->VerifyCanaries( HEAP_CANARY_BLOCKS_PER_TICK );
+    return 0;
+  }
+
+  // Reports a damaged block and restores its canaries so the same
+  // corruption is only reported once
+  void CheckCanaries( const void* p, AllocationInfo& info )
+  {
+#if ENABLE_GUARDED_SAMPLING
+    if ( guardedPool.Owns( p ) )
+      return;
+#endif // ENABLE_GUARDED_SAMPLING
+
+    bool frontIntact = IsCanaryIntact( GetFrontCanary( p ) );
+    bool backIntact = IsCanaryIntact( GetBackCanary( p ) );
+    if ( frontIntact && backIntact )
+      return;
+
+    TCHAR buffer[ 1024 ];
+    _sntprintf_s( buffer, 1023, _T( "**** ERROR: Heap corruption detected: %zu byte block at %p has a damaged %s canary!\n\0" ), info.GetSize(), p, frontIntact ? _T( "back" ) : backIntact ? _T( "front" ) : _T( "front and back" ) );
+    OutputDebugString( buffer );
+#ifdef ENABLE_STACK_TRACE
+    OutputDebugString( _T( "\tAllocated at:\n" ) );
+    info.DumpStack();
+#endif // ENABLE_STACK_TRACE
+
+    memset( GetFrontCanary( p ), canaryValue, HEAP_CANARY_SIZE );
+    memset( GetBackCanary( p ), canaryValue, HEAP_CANARY_SIZE );
+  }
+
+  // Checks at most maxBlocks blocks of a table, continuing where the previous call left off
+  void VerifyTableCanaries( PointerTable<AllocationInfo>& table, size_t& cursor, size_t maxBlocks )
+  {
+    size_t capacity = table.Capacity();
+    size_t checked = 0;
+    for ( size_t x = 0; x < capacity && checked < maxBlocks; x++ )
+    {
+      cursor = ( cursor + 1 ) % capacity;
+      if ( auto entry = table.GetSlot( cursor ) )
+      {
+        CheckCanaries( entry->GetKey(), entry->value );
+        checked++;
+      }
+    }
+  }
+
+  void VerifyCanaries( size_t maxBlocks )
+  {
+    Lock cs( critsec );
+    if ( paused )
+      return;
+
+#if ENABLE_PER_THREAD_TABLES
+    // one thread's table per call, round robin
+    size_t index = 0;
+    threadRegistry.ForEach( [ & ]( ThreadRecord& record )
+    {
+      OwnedTable* owned = record.ownedTable.load( std::memory_order_acquire );
+      if ( index++ != canaryRecord || !owned )
+        return;
+
+      owned->BeginInspection();
+      VerifyTableCanaries( owned->table, owned->canarySlot, maxBlocks );
+      owned->EndInspection();
+    } );
+    canaryRecord = canaryRecord + 1 < index ? canaryRecord + 1 : 0;
+#else
+    updatingTable = true;
+    VerifyTableCanaries( memTrackerPool, canarySlot, maxBlocks );
+    updatingTable = false;
+#endif // ENABLE_PER_THREAD_TABLES
+  }
+#endif // ENABLE_HEAP_CANARIES
+
+public:
+
+  MemTracker()
+  {
+    paused = false;
+#if ENABLE_HEAP_CANARIES
+    canaryThreadStop = CreateEvent( NULL, TRUE, FALSE, NULL );
+    canaryThread = CreateThread( NULL, 0, CanaryThreadProc, this, 0, NULL );
+    if ( canaryThread )
+      SetThreadPriority( canaryThread, THREAD_PRIORITY_BELOW_NORMAL );
+#endif // ENABLE_HEAP_CANARIES
+#if ENABLE_HEATMAP
+    heatmapThreadStop = CreateEvent( NULL, TRUE, FALSE, NULL );
+    heatmapThread = CreateThread( NULL, 0, HeatmapThreadProc, this, 0, NULL );
+#endif // ENABLE_HEATMAP
+  }
+
+  ~MemTracker()
+  {
+#if ENABLE_HEAP_CANARIES
+    if ( canaryThread )
+    {
+      SetEvent( canaryThreadStop );
+      WaitForSingleObject( canaryThread, INFINITE );
+      CloseHandle( canaryThread );
+    }
+    CloseHandle( canaryThreadStop );
+    ForEachAllocation( [ & ]( const void* p, AllocationInfo& info ) { CheckCanaries( p, info ); } );
+#endif // ENABLE_HEAP_CANARIES
+
+#if ENABLE_HEATMAP
+    if ( heatmapThread )
+    {
+      SetEvent( heatmapThreadStop );
+      WaitForSingleObject( heatmapThread, INFINITE );
+      CloseHandle( heatmapThread );
+    }
+    CloseHandle( heatmapThreadStop );
+#endif // ENABLE_HEATMAP
+
+    paused = true;
+
+#if ENABLE_HEATMAP
+    heatmap.Write();
+#endif // ENABLE_HEATMAP
+
+#if ENABLE_LATENCY_HISTOGRAMS
+    ReportLatency();
+#endif // ENABLE_LATENCY_HISTOGRAMS
+
+#if ENABLE_RESERVE_DETECTOR
+    reserveDetector.Report();
+#endif // ENABLE_RESERVE_DETECTOR
+
+#if ENABLE_STARTUP_PHASES
+    phaseProfile.Report( ProcessPhase::SteadyState );
+#endif // ENABLE_STARTUP_PHASES
+
+#if ENABLE_EPOCH_PROFILE
+    epochProfile.Report();
+#endif // ENABLE_EPOCH_PROFILE
+
+#if ENABLE_COROUTINE_ATTRIBUTION
+    coroutineProfile.Report();
+#endif // ENABLE_COROUTINE_ATTRIBUTION
+
+#if ENABLE_EXCEPTION_TRACKING
+    exceptionTracker.Report();
+#endif // ENABLE_EXCEPTION_TRACKING
+
+#if ENABLE_PAGE_FAULT_SAMPLING
+    pageFaultProfile.Report();
+#endif // ENABLE_PAGE_FAULT_SAMPLING
+
+#if ENABLE_NO_ALLOC_ZONES
+    if ( noAllocViolations.load() )
+    {
+      TCHAR noAllocBuffer[ 1024 ];
+      _sntprintf_s( noAllocBuffer, 1023, _T( "**** ERROR: %llu allocations or frees in no-allocation zones!\n\0" ), noAllocViolations.load() );
+      OutputDebugString( noAllocBuffer );
+    }
+#endif // ENABLE_NO_ALLOC_ZONES
+
+#if ENABLE_LARGE_PAGES
+    TCHAR metadataBuffer[ 1024 ];
+    _sntprintf_s( metadataBuffer, 1023, _T( "Tracker metadata: %zu KB, %zu KB backed by large pages\n\0" ), metadataBytes / 1024, largePageMetadataBytes / 1024 );
+    OutputDebugString( metadataBuffer );
+#endif // ENABLE_LARGE_PAGES
+
+#if ENABLE_COMPACT_ENTRIES && defined( ENABLE_STACK_TRACE )
+    TCHAR depotBuffer[ 1024 ];
+    _sntprintf_s( depotBuffer, 1023, _T( "Stack depot: %u unique stacks in %u modules\n\0" ), stackDepot.GetStackCount(), stackDepot.GetModuleCount() );
+    OutputDebugString( depotBuffer );
+#endif // ENABLE_COMPACT_ENTRIES
+
+#if ENABLE_EVENT_RINGS
+    if ( eventRings.IsConnected() )
+    {
+      OutputDebugString( _T( "Memory leaks are reported by the analyzer process\n" ) );
+      return;
+    }
+#endif // ENABLE_EVENT_RINGS
+
+    size_t leakCount = 0;
+    ForEachAllocation( [ & ]( const void*, AllocationInfo& ) { leakCount++; } );
+
+    if ( leakCount )
+    {
+      //report leaks
+      OutputDebugString( _T( "\n--- Memleaks start here ---\n\n" ) );
+
+      size_t totalLeaked = 0;
+
+      TCHAR buffer[ 1024 ];
+
+      ForEachAllocation( [ & ]( const void*, AllocationInfo& info )
+      {
+        _sntprintf_s( buffer, 1023, _T( "Leak: %zu bytes\n\0" ), info.GetSize() );
+        OutputDebugString( buffer );
+
+#ifdef ENABLE_STACK_TRACE
+        info.DumpStack();
+#endif
+        totalLeaked += info.GetSize();
+      } );
+
+      _sntprintf_s( buffer, 1023, _T( "\tTotal bytes leaked: %zu\n\n\0" ), totalLeaked );
+      OutputDebugString( buffer );
+
+#if ENABLE_MODULE_ATTRIBUTION
+      ReportModules( _T( "Leaks per module" ) );
+#endif // ENABLE_MODULE_ATTRIBUTION
+    }
+    else
+    {
+      OutputDebugString( _T( "**********************************************************\n\t\t\t\t\tNo memleaks found.\n**********************************************************\n\n" ) );
+    }
+  }
+
+  // allocatorCycles is the time spent in the underlying allocator
+  void AddPointer( void* p, size_t size, unsigned long long allocatorCycles = 0 )
+  {
+    // the stack is captured before taking the lock to keep the lock hold time short
+    LATENCY_START( captureStart );
+#ifdef ENABLE_STACK_TRACE
+    StackTracker stack( INNER_STACK_OFFSET );
+    void* const* frames = stack.GetFrames();
+    const uint32_t frameCount = STACK_TRACE_DEPTH;
+#else
+    void* const* frames = nullptr;
+    const uint32_t frameCount = 0;
+#endif // ENABLE_STACK_TRACE
+    LATENCY_RECORD( LatencyPhase::StackCapture, captureStart );
+
+#if ENABLE_EVENT_TRACE
+    if ( IsTracking() && p )
+      eventTrace.Record( EventType::Allocate, p, size, frames, frameCount );
+#endif // ENABLE_EVENT_TRACE
+
+#if ENABLE_EVENT_RINGS
+    if ( eventRings.IsConnected() )
+    {
+      if ( IsTracking() && p )
+        eventRings.Write( EventType::Allocate, p, size, frames, frameCount );
+      return;
+    }
+#endif // ENABLE_EVENT_RINGS
+
+    AllocationInfo info( size, frames );
+
+#if ENABLE_MODULE_ATTRIBUTION
+    // resolved now, the module may be unloaded by the time of a report
+    if ( IsTracking() && p )
+      info.SetModule( moduleMap.GetOwner( stack ) );
+#endif // ENABLE_MODULE_ATTRIBUTION
+
+#if ENABLE_RESERVE_DETECTOR
+    if ( IsTracking() && p )
+      reserveDetector.OnAllocate( info );
+#endif // ENABLE_RESERVE_DETECTOR
+
+#if ENABLE_STARTUP_PHASES
+    if ( IsTracking() && p )
+      phaseProfile.RecordAllocation( info, allocatorCycles );
+#endif // ENABLE_STARTUP_PHASES
+
+#if ENABLE_EPOCH_PROFILE
+    if ( IsTracking() && p )
+      epochProfile.RecordAllocation( info );
+#endif // ENABLE_EPOCH_PROFILE
+
+#if ENABLE_COROUTINE_ATTRIBUTION
+    if ( IsTracking() && p && allocatingCoroutineFrame )
+      coroutineProfile.RecordFrame( *allocatingCoroutineFrame, info );
+#endif // ENABLE_COROUTINE_ATTRIBUTION
+
+#if ENABLE_PAGE_FAULT_SAMPLING
+    if ( IsTracking() && p )
+      pageFaultProfile.OnAllocate( p, size, info );
+#endif // ENABLE_PAGE_FAULT_SAMPLING
+
+#if ENABLE_LOCALITY_REPORT
+    if ( IsTracking() && p )
+      allocationDistances.OnAllocate( p, info );
+#endif // ENABLE_LOCALITY_REPORT
+
+#if ENABLE_PER_THREAD_TABLES
+    if ( !IsTracking() || !p )
+      return;
+
+    ThreadRecord* record = threadRegistry.GetCurrent();
+    if ( !record )
+    {
+      AddSharedPointer( p, info );
+      return;
+    }
+
+    OwnedTable* owned = GetOwnedTable( record );
+    if ( !owned )
+      return;
+
+    LATENCY_START( updateStart );
+    owned->BeginUpdate();
+    ApplyRemoteFrees( *owned );
+    owned->table.InsertOrAssign( p, info );
+    owned->EndUpdate();
+    GetBlockOwner( p ) = record;
+    LATENCY_RECORD( LatencyPhase::TableUpdate, updateStart );
+#else
+    LATENCY_START( lockStart );
+    Lock cs( critsec );
+    LATENCY_RECORD( LatencyPhase::LockWait, lockStart );
+    if ( IsTracking() && p )
+    {
+      LATENCY_START( updateStart );
+      updatingTable = true;
+      memTrackerPool.InsertOrAssign( p, info );
+      updatingTable = false;
+      LATENCY_RECORD( LatencyPhase::TableUpdate, updateStart );
+    }
+#endif // ENABLE_PER_THREAD_TABLES
+  }
+
+  // Returns false if the block was handed to its owning thread, which releases it later
+  bool RemovePointer( void* p )
+  {
+#if ENABLE_EPOCH_PROFILE
+    if ( IsTracking() && p )
+      epochProfile.RecordFree();
+#endif // ENABLE_EPOCH_PROFILE
+
+#if ENABLE_EVENT_TRACE
+    if ( IsTracking() && p )
+      eventTrace.Record( EventType::Free, p, 0, nullptr, 0 );
+#endif // ENABLE_EVENT_TRACE
+
+#if ENABLE_EVENT_RINGS
+    if ( eventRings.IsConnected() )
+    {
+      if ( IsTracking() && p )
+        eventRings.Write( EventType::Free, p, 0, nullptr, 0 );
+      return true;
+    }
+#endif // ENABLE_EVENT_RINGS
+
+#if ENABLE_PER_THREAD_TABLES
+    if ( !IsTracking() || !p )
+      return true;
+
+    ThreadRecord* owner = GetBlockOwner( p );
+    if ( !owner )
+    {
+      OutputDebugString( _T( "**** ERROR: Trying to delete non logged memory block!\n" ) );
+#ifdef ENABLE_STACK_TRACE
+      StackTracker s( INNER_STACK_OFFSET );
+      s.DumpToDebugOutput();
+#endif // ENABLE_STACK_TRACE
+      return true;
+    }
+
+    OwnedTable* owned = owner->ownedTable.load( std::memory_order_acquire );
+    if ( owner == sharedRecord.load( std::memory_order_acquire ) )
+    {
+      Lock cs( critsec );
+      EraseEntry( owned->table, p );
+      return true;
+    }
+
+    if ( owner != threadRegistry.GetCurrent() )
+    {
+      // the owner is checked after the push, an exiting owner drains what was queued before it left
+      if ( owned->PushRemoteFree( p ) || !owner->inUse )
+        DrainRemoteFrees( *owned );
+      return false;
+    }
+
+    LATENCY_START( updateStart );
+    owned->BeginUpdate();
+    ApplyRemoteFrees( *owned );
+    EraseEntry( owned->table, p );
+    owned->EndUpdate();
+    LATENCY_RECORD( LatencyPhase::TableUpdate, updateStart );
+#else
+    LATENCY_START( lockStart );
+    Lock cs( critsec );
+    LATENCY_RECORD( LatencyPhase::LockWait, lockStart );
+    if ( IsTracking() && p )
+    {
+      LATENCY_START( updateStart );
+      updatingTable = true;
+      EraseEntry( memTrackerPool, p );
+      updatingTable = false;
+      LATENCY_RECORD( LatencyPhase::TableUpdate, updateStart );
+    }
+#endif // ENABLE_PER_THREAD_TABLES
+    return true;
+  }
+
+#if ENABLE_PER_THREAD_TABLES
+  void DrainExitedThread( ThreadRecord& record )
+  {
+    OwnedTable* owned = record.ownedTable.load( std::memory_order_acquire );
+    if ( owned && IsTracking() )
+      DrainRemoteFrees( *owned );
+  }
+#endif // ENABLE_PER_THREAD_TABLES
+
+#if ENABLE_RESERVE_DETECTOR
+  void ReportMissingReserves()
+  {
+    reserveDetector.Report();
+  }
+#endif // ENABLE_RESERVE_DETECTOR
+
+#if ENABLE_STARTUP_PHASES
+  void EndStaticInitialization()
+  {
+    phaseProfile.Enter( ProcessPhase::Startup );
+  }
+
+  void MarkReady()
+  {
+    if ( phaseProfile.Enter( ProcessPhase::SteadyState ) )
+      phaseProfile.Report( ProcessPhase::Startup );
+  }
+
+  void RecordFree( unsigned long long allocatorCycles )
+  {
+    if ( IsTracking() )
+      phaseProfile.RecordFree( allocatorCycles );
+  }
+#endif // ENABLE_STARTUP_PHASES
+
+#if ENABLE_EPOCH_PROFILE
+  void MarkEpoch()
+  {
+    epochProfile.EndEpoch();
+  }
+
+  void ReportEpochs()
+  {
+    epochProfile.Report();
+  }
+#endif // ENABLE_EPOCH_PROFILE
+
+#if ENABLE_COROUTINE_ATTRIBUTION
+  void RecordCoroutineFrameFree( const CoroutineFrameHeader& frame )
+  {
+    if ( IsTracking() )
+      coroutineProfile.RecordFree( frame );
+  }
+
+  void ReportCoroutineFrames()
+  {
+    coroutineProfile.Report();
+  }
+#endif // ENABLE_COROUTINE_ATTRIBUTION
+
+#if ENABLE_PAGE_FAULT_SAMPLING
+  void ReportPageFaults()
+  {
+    pageFaultProfile.Report();
+  }
+#endif // ENABLE_PAGE_FAULT_SAMPLING
+
+#if ENABLE_DUMP_DESCRIPTOR
+  DumpDescriptor DescribeLayout( const DumpDescriptor* self )
+  {
+    DumpDescriptor descriptor = {};
+    memcpy( descriptor.magic, dumpDescriptorMagic, sizeof( descriptor.magic ) );
+    descriptor.self = (uintptr_t)self;
+    descriptor.version = dumpDescriptorVersion;
+    descriptor.pointerSize = sizeof( void* );
+    descriptor.stackDepth = STACK_TRACE_DEPTH;
+#ifdef ENABLE_STACK_TRACE
+    descriptor.flags |= dumpStackTraces;
+#endif // ENABLE_STACK_TRACE
+#if ENABLE_PER_THREAD_TABLES
+    threadRegistry.DescribeLayout( descriptor );
+#else
+    descriptor.table = (uintptr_t)&memTrackerPool;
+#endif // ENABLE_PER_THREAD_TABLES
+    PointerTable<AllocationInfo>::DescribeLayout( descriptor );
+#if ENABLE_COMPACT_ENTRIES && defined( ENABLE_STACK_TRACE )
+    stackDepot.DescribeLayout( descriptor );
+#endif // ENABLE_COMPACT_ENTRIES
+    return descriptor;
+  }
+#endif // ENABLE_DUMP_DESCRIPTOR
+
+#if ENABLE_CONTENT_ANALYSIS
+  // Returns true if a freed block is left to the running analysis pass
+  bool HoldFreedBlock( void* p )
+  {
+    if ( !p || !holdingFrees.load() )
+      return false;
+
+    {
+      Lock cs( heldBlocksLock );
+      if ( !holdingFrees.load( std::memory_order_relaxed ) )
+        return false;
+      if ( heldBlocks.Find( (uint64_t)p, true ) )
+        return true;
+    }
+
+    // no memory to hold the block, it's released once the pass is done
+    while ( holdingFrees.load() )
+      SwitchToThread();
+    return false;
+  }
+
+  void ReportDuplicateBlocks()
+  {
+    struct SiteStats : SiteRecord
+    {
+      uint64_t duplicateBlocks;
+      uint64_t duplicateBytes;
+      uint64_t zeroBlocks;
+      uint64_t zeroBytes;
+    };
+
+    size_t capacity = 0;
+    ForEachTable( [ & ]( PointerTable<AllocationInfo>& table ) { capacity += table.Size(); } );
+    capacity += capacity / 4 + 1024; // tables may grow between the two passes
+    BlockContent* blocks = (BlockContent*)VirtualAlloc( NULL, capacity * sizeof( BlockContent ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    if ( !blocks )
+      return;
+
+    // the blocks are listed under the lock and hashed without it, the ones
+    // freed meanwhile are held until the pass is done
+    Lock pass( contentAnalysisLock );
+    holdingFrees.store( true );
+    RecordTable<SiteStats> sites;
+    size_t count = 0;
+    ForEachTable( [ & ]( PointerTable<AllocationInfo>& table )
+    {
+      table.ForEach( [ & ]( PointerTable<AllocationInfo>::Entry& entry )
+      {
+        if ( count == capacity )
+          return;
+
+        blocks[ count++ ] = BlockContent{ entry.GetKey(), entry.value.GetSize(), 0, entry.value.GetSite(), false };
+        FindSite( sites, entry.value );
+      } );
+    } );
+    ContentHasher( blocks, count ).Hash();
+    ReleaseHeldBlocks();
+
+    uint64_t totalDuplicateBytes = 0;
+    uint64_t totalZeroBytes = 0;
+    std::sort( blocks, blocks + count );
+    for ( size_t x = 0; x < count; x++ )
+    {
+      SiteStats* site = sites.Find( SiteRecord::GetKey( blocks[ x ].site ), false );
+      if ( !site )
+        continue;
+
+      if ( x && !( blocks[ x - 1 ] < blocks[ x ] ) )
+      {
+        site->duplicateBlocks++;
+        site->duplicateBytes += blocks[ x ].size;
+        totalDuplicateBytes += blocks[ x ].size;
+      }
+      if ( blocks[ x ].zero && blocks[ x ].size )
+      {
+        site->zeroBlocks++;
+        site->zeroBytes += blocks[ x ].size;
+        totalZeroBytes += blocks[ x ].size;
+      }
+    }
+    VirtualFree( blocks, 0, MEM_RELEASE );
+
+    TCHAR buffer[ 1024 ];
+    OutputDebugString( _T( "\n--- Duplicate and all-zero blocks ---\n\n" ) );
+    auto wasted = []( const SiteStats& site ) { return std::max( site.duplicateBytes, site.zeroBytes ); };
+    sites.ForEachTopN<CONTENT_REPORT_SITES>( [ & ]( const SiteStats& a, const SiteStats& b ) { return wasted( a ) > wasted( b ); }, [ & ]( SiteStats& site )
+    {
+      _sntprintf_s( buffer, 1023, _T( "%llu duplicate blocks of %llu bytes, %llu all-zero blocks of %llu bytes\n\0" ), site.duplicateBlocks, site.duplicateBytes, site.zeroBlocks, site.zeroBytes );
+      OutputDebugString( buffer );
+      site.DumpStack();
+    }, [ & ]( const SiteStats& site ) { return wasted( site ) != 0; } );
+    _sntprintf_s( buffer, 1023, _T( "\t%zu live blocks, %llu bytes could be saved by deduplication, %llu bytes are all zero\n\n\0" ), count, totalDuplicateBytes, totalZeroBytes );
+    OutputDebugString( buffer );
+  }
+#endif // ENABLE_CONTENT_ANALYSIS
+
+#if ENABLE_LOCALITY_REPORT
+  void ReportLocality()
+  {
+    struct Block
+    {
+      uint32_t site;
+      uintptr_t address;
+      size_t size;
+
+      bool operator<( const Block& other ) const
+      {
+        return site != other.site ? site < other.site : address < other.address;
+      }
+    };
+
+    struct SiteStats : SiteRecord
+    {
+      uint64_t objects;
+      uint64_t bytes;
+      uint64_t pages;
+      uint64_t lines;
+      uint64_t excessPages;
+    };
+
+    const uintptr_t lineSize = 64;
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo( &systemInfo );
+    const uintptr_t pageSize = systemInfo.dwPageSize;
+
+    size_t capacity = 0;
+    ForEachTable( [ & ]( PointerTable<AllocationInfo>& table ) { capacity += table.Size(); } );
+    capacity += capacity / 4 + 1024; // tables may grow between the two passes
+    Block* blocks = (Block*)VirtualAlloc( NULL, capacity * sizeof( Block ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    if ( !blocks )
+      return;
+
+    RecordTable<SiteStats> sites;
+    size_t count = 0;
+    ForEachAllocation( [ & ]( const void* p, AllocationInfo& info )
+    {
+      if ( count == capacity )
+        return;
+
+      blocks[ count++ ] = Block{ info.GetSite(), (uintptr_t)p, std::max( info.GetSize(), (size_t)1 ) };
+      FindSite( sites, info );
+    } );
+
+    // walking each site's blocks in address order counts every page and cache line once
+    std::sort( blocks, blocks + count );
+    uintptr_t nextLine = 0;
+    uintptr_t nextPage = 0;
+    for ( size_t x = 0; x < count; x++ )
+    {
+      if ( !x || blocks[ x ].site != blocks[ x - 1 ].site )
+        nextLine = nextPage = 0;
+
+      SiteStats* site = sites.Find( SiteRecord::GetKey( blocks[ x ].site ), false );
+      if ( !site )
+        continue;
+
+      uintptr_t last = blocks[ x ].address + blocks[ x ].size - 1;
+      if ( last / lineSize >= nextLine )
+      {
+        site->lines += last / lineSize - std::max( blocks[ x ].address / lineSize, nextLine ) + 1;
+        nextLine = last / lineSize + 1;
+      }
+      if ( last / pageSize >= nextPage )
+      {
+        site->pages += last / pageSize - std::max( blocks[ x ].address / pageSize, nextPage ) + 1;
+        nextPage = last / pageSize + 1;
+      }
+      site->objects++;
+      site->bytes += blocks[ x ].size;
+    }
+    VirtualFree( blocks, 0, MEM_RELEASE );
+
+    // the sites spread over the most pages beyond what their bytes would fill come first
+    sites.ForEach( [ & ]( SiteStats& site ) { site.excessPages = site.pages - ( site.bytes + pageSize - 1 ) / pageSize; } );
+
+    TCHAR buffer[ 1024 ];
+    OutputDebugString( _T( "\n--- Spatial locality of live objects per call site ---\n\n" ) );
+    sites.ForEachTopN<LOCALITY_REPORT_SITES>( []( const SiteStats& a, const SiteStats& b ) { return a.excessPages > b.excessPages; }, [ & ]( SiteStats& site )
+    {
+      double perThousand = 1000.0 / site.objects;
+      _sntprintf_s( buffer, 1023, _T( "%llu objects of %llu bytes: %.1f pages and %.1f cache lines per 1000 objects (%.1f and %.1f packed)\n\0" ), site.objects, site.bytes,
+                    site.pages * perThousand, site.lines * perThousand, ( site.bytes + pageSize - 1 ) / pageSize * perThousand, ( site.bytes + lineSize - 1 ) / lineSize * perThousand );
+      OutputDebugString( buffer );
+      double distance = allocationDistances.GetMeanDistance( site.info.GetSite() );
+      if ( distance >= 0 )
+      {
+        _sntprintf_s( buffer, 1023, _T( "\t%.0f bytes between consecutive allocations (geometric mean)\n\0" ), distance );
+        OutputDebugString( buffer );
+      }
+      site.DumpStack();
+    }, []( const SiteStats& site ) { return site.objects >= 2 && site.excessPages; } );
+    OutputDebugString( _T( "\n" ) );
+  }
+#endif // ENABLE_LOCALITY_REPORT
+
+#if ENABLE_MODULE_ATTRIBUTION
+  void ReportModules( const TCHAR* title )
+  {
+    struct ModuleBytes
+    {
+      uint64_t bytes;
+      uint64_t count;
+      uint16_t module;
+    };
+
+    // the last slot collects allocations without a module
+    ModuleBytes* totals = (ModuleBytes*)VirtualAlloc( NULL, sizeof( ModuleBytes ) * ( ModuleMap::unknownModule + 1 ), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    if ( !totals )
+      return;
+
+    ForEachAllocation( [ & ]( const void*, AllocationInfo& info )
+    {
+      ModuleBytes& total = totals[ info.GetModule() ];
+      total.bytes += info.GetSize();
+      total.count++;
+    } );
+
+    uint32_t moduleCount = moduleMap.GetModuleCount();
+    totals[ moduleCount ] = totals[ ModuleMap::unknownModule ];
+    for ( uint32_t x = 0; x <= moduleCount; x++ )
+      totals[ x ].module = x < moduleCount ? (uint16_t)x : ModuleMap::unknownModule;
+    std::sort( totals, totals + moduleCount + 1, []( const ModuleBytes& a, const ModuleBytes& b ) { return a.bytes > b.bytes; } );
+
+    TCHAR buffer[ 1024 ];
+    TCHAR name[ MAX_PATH ];
+    _sntprintf_s( buffer, 1023, _T( "\n--- %s ---\n\n\0" ), title );
+    OutputDebugString( buffer );
+    for ( uint32_t x = 0; x <= moduleCount && totals[ x ].count; x++ )
+    {
+      moduleMap.GetModuleName( totals[ x ].module, name, MAX_PATH );
+      _sntprintf_s( buffer, 1023, _T( "%14llu bytes in %10llu allocations  %s\n\0" ), totals[ x ].bytes, totals[ x ].count, name );
+      OutputDebugString( buffer );
+    }
+    OutputDebugString( _T( "\n" ) );
+
+    VirtualFree( totals, 0, MEM_RELEASE );
+  }
+#endif // ENABLE_MODULE_ATTRIBUTION
+
+  void Pause()
+  {
+    Lock cs( critsec );
+    paused = true;
+  }
+
+  void Resume()
+  {
+    Lock cs( critsec );
+    paused = false;
+  }
+};
+
+//This should force the memTracker variable to be constructed before everything else:
+#pragma warning(disable:4074)
+#pragma init_seg(compiler)
+#if ENABLE_COMPACT_ENTRIES && defined( ENABLE_STACK_TRACE )
+StackDepot stackDepot; // needs to outlive memTracker
+#endif // ENABLE_COMPACT_ENTRIES
+#if ENABLE_EXCEPTION_TRACKING
+ExceptionTracker exceptionTracker; // needs to outlive memTracker
+#endif // ENABLE_EXCEPTION_TRACKING
+thread_local bool MemTracker::updatingTable = false;
+MemTracker memTracker;
+
+#if ENABLE_DUMP_DESCRIPTOR
+// Exported so the linker keeps it
+extern "C" __declspec( dllexport ) DumpDescriptor MemLeakTrackerDescriptor;
+DumpDescriptor MemLeakTrackerDescriptor = memTracker.DescribeLayout( &MemLeakTrackerDescriptor );
+#endif // ENABLE_DUMP_DESCRIPTOR
+
+#if ENABLE_PER_THREAD_TABLES
+void DrainExitedThread( ThreadRecord& record )
+{
+  memTracker.DrainExitedThread( record );
+}
+#endif // ENABLE_PER_THREAD_TABLES
+
+#if ENABLE_STARTUP_PHASES
+void __cdecl EndStaticInitialization()
+{
+  memTracker.EndStaticInitialization();
+}
+
+// .CRT$XCY runs after the C++ initializers of the module in .CRT$XCU. Nothing
+// references the pointer, so the linker is told to keep it with /OPT:REF.
+#pragma section( ".CRT$XCY", read )
+extern "C" void( __cdecl* MemLeakTrackerEndStaticInitialization )();
+__declspec( allocate( ".CRT$XCY" ) ) void( __cdecl* MemLeakTrackerEndStaticInitialization )() = EndStaticInitialization;
+#ifdef _WIN64
+#pragma comment(linker,"/include:MemLeakTrackerEndStaticInitialization")
+#else
+#pragma comment(linker,"/include:_MemLeakTrackerEndStaticInitialization")
+#endif // _WIN64
+#endif // ENABLE_STARTUP_PHASES
+#endif // ENABLE_MEMORY_LEAK_TRACKING
+
+// The underlying allocation, sampled for page faults before anything is written to it
+void* AllocateRaw( size_t size )
+{
+  void* p = malloc( size );
+#if ENABLE_PAGE_FAULT_SAMPLING
+  if ( p )
+    PageFaultProfile::SampleBlock( p, size );
+#endif // ENABLE_PAGE_FAULT_SAMPLING
+  return p;
+}
+
+void ReleaseBlockMemory( void* p )
+{
+#if ENABLE_STARTUP_PHASES
+  unsigned long long start = __rdtsc();
+#endif // ENABLE_STARTUP_PHASES
+#if ENABLE_GUARDED_SAMPLING
+  if ( guardedPool.Owns( p ) )
+    guardedPool.Free( p );
+  else
+#endif // ENABLE_GUARDED_SAMPLING
+#ifdef USE_BLOCK_HEADERS
+    FreeWithHeader( p );
+#else
+    free( p );
+#endif // USE_BLOCK_HEADERS
+#if ENABLE_STARTUP_PHASES
+  memTracker.RecordFree( __rdtsc() - start );
+#endif // ENABLE_STARTUP_PHASES
+}
+
+#ifdef ENABLE_ALLOCATION_COUNTERS
+void CountBytes( std::atomic<unsigned long long>& counter, size_t bytes )
+{
+  counter.store( counter.load( std::memory_order_relaxed ) + bytes, std::memory_order_relaxed );
+}
+
+size_t GetBlockSize( void* p )
+{
+#if ENABLE_GUARDED_SAMPLING
+  if ( guardedPool.Owns( p ) )
+    return guardedPool.GetSize( p );
+#endif // ENABLE_GUARDED_SAMPLING
+#ifdef USE_BLOCK_HEADERS
+  return GetBlockHeader( p )->size;
+#else
+  return _msize( p );
+#endif // USE_BLOCK_HEADERS
+}
+#endif // ENABLE_ALLOCATION_COUNTERS
+
+void* AllocateBlock( size_t size )
+{
+#if ENABLE_NO_ALLOC_ZONES
+  if ( noAllocDepth )
+    ReportNoAllocViolation( _T( "**** ERROR: Allocation in a no-allocation zone!\n" ) );
+#endif // ENABLE_NO_ALLOC_ZONES
+  LATENCY_START( start );
+#if ENABLE_STARTUP_PHASES
+  unsigned long long allocatorStart = __rdtsc();
+#endif // ENABLE_STARTUP_PHASES
+  void* p = nullptr;
+#if ENABLE_GUARDED_SAMPLING
+  if ( guardedPool.ShouldSample() )
+    p = guardedPool.Allocate( size );
+#endif // ENABLE_GUARDED_SAMPLING
+  if ( !p )
+#ifdef USE_BLOCK_HEADERS
+    p = AllocateWithHeader( size );
+#else
+    p = AllocateRaw( size );
+#endif // USE_BLOCK_HEADERS
+#if ENABLE_STARTUP_PHASES
+  memTracker.AddPointer( p, size, __rdtsc() - allocatorStart );
+#elif defined( ENABLE_MEMORY_LEAK_TRACKING )
+  memTracker.AddPointer( p, size );
+#endif // ENABLE_STARTUP_PHASES
+#ifdef ENABLE_ALLOCATION_COUNTERS
+  ThreadRecord* record = threadRegistry.GetCurrent();
+  if ( p && record )
+    CountBytes( record->allocatedBytes, size );
+#endif // ENABLE_ALLOCATION_COUNTERS
+  LATENCY_RECORD( LatencyPhase::New, start );
+  return p;
+}
+
+void FreeBlock( void* p )
+{
+#if ENABLE_NO_ALLOC_ZONES
+  if ( noAllocDepth && p )
+    ReportNoAllocViolation( _T( "**** ERROR: Free in a no-allocation zone!\n" ) );
+#endif // ENABLE_NO_ALLOC_ZONES
+  LATENCY_START( start );
+#ifdef ENABLE_ALLOCATION_COUNTERS
+  ThreadRecord* record = threadRegistry.GetCurrent();
+  if ( p && record )
+    CountBytes( record->freedBytes, GetBlockSize( p ) );
+#endif // ENABLE_ALLOCATION_COUNTERS
+#if ENABLE_CONTENT_ANALYSIS
+  if ( memTracker.RemovePointer( p ) && !memTracker.HoldFreedBlock( p ) )
+#elif defined( ENABLE_MEMORY_LEAK_TRACKING )
+  if ( memTracker.RemovePointer( p ) )
+#endif // ENABLE_CONTENT_ANALYSIS
+    ReleaseBlockMemory( p );
+  LATENCY_RECORD( LatencyPhase::Delete, start );
+}
+}
+
+void* __cdecl operator new( size_t size )
+{
+  return LeakTracker::AllocateBlock( size );
+}
+
+void* __cdecl operator new[]( size_t size )
+{
+  return LeakTracker::AllocateBlock( size );
+}
+
+void* __cdecl operator new( size_t size, const char* file, int line )
+{
+  return LeakTracker::AllocateBlock( size );
+}
+
+void* __cdecl operator new[]( size_t size, const char* file, int line )
+{
+  return LeakTracker::AllocateBlock( size );
+}
+
+void __cdecl operator delete( void* pointer )
+{
+  LeakTracker::FreeBlock( pointer );
 }
 
 void __cdecl operator delete[]( void* pointer )
 {
-  LeakTracker::memTracker.RemovePointer( pointer );
-  free( pointer );
+  LeakTracker::FreeBlock( pointer );
+}
+
+void __cdecl operator delete( void* pointer, const char* file, int line )
+{
+  LeakTracker::FreeBlock( pointer );
+}
+
+void __cdecl operator delete[]( void* pointer, const char* file, int line )
+{
+  LeakTracker::FreeBlock( pointer );
+}
+
+#endif // OVERRIDE_NEW_DELETE
+
+//////////////////////////////////////////////////////////////////////////
+// Runtime API, see MemLeakTracker.h
+// These are always defined so code calling them builds in every configuration.
+
+namespace LeakTracker
+{
+
+void DumpLatencyHistograms()
+{
+#if ENABLE_LATENCY_HISTOGRAMS
+  ReportLatency();
+#endif
+}
+
+void DumpLiveBytesPerModule()
+{
+#if ENABLE_MODULE_ATTRIBUTION
+  memTracker.ReportModules( _T( "Live bytes per module" ) );
+#endif
+}
+
+void MarkReady()
+{
+#if ENABLE_STARTUP_PHASES
+  memTracker.MarkReady();
+#endif
+}
+
+void MarkEpoch()
+{
+#if ENABLE_EPOCH_PROFILE
+  memTracker.MarkEpoch();
+#endif
+}
+
+void DumpEpochProfile()
+{
+#if ENABLE_EPOCH_PROFILE
+  memTracker.ReportEpochs();
+#endif
+}
+
+void* AllocateCoroutineFrame( size_t size, const void* coroutine )
+{
+#if ENABLE_COROUTINE_ATTRIBUTION
+  CoroutineFrameHeader frame = { coroutine, size };
+  allocatingCoroutineFrame = &frame;
+  void* p = operator new( size + coroutineFrameHeaderSize );
+  allocatingCoroutineFrame = nullptr;
+  if ( !p )
+    return nullptr;
+  *(CoroutineFrameHeader*)p = frame;
+  return (char*)p + coroutineFrameHeaderSize;
+#else
+  return operator new( size );
+#endif
+}
+
+void FreeCoroutineFrame( void* p )
+{
+#if ENABLE_COROUTINE_ATTRIBUTION
+  if ( !p )
+    return;
+
+  p = (char*)p - coroutineFrameHeaderSize;
+  memTracker.RecordCoroutineFrameFree( *(CoroutineFrameHeader*)p );
+#endif
+  operator delete( p );
+}
+
+void DumpCoroutineFrames()
+{
+#if ENABLE_COROUTINE_ATTRIBUTION
+  memTracker.ReportCoroutineFrames();
+#endif
+}
+
+void DumpExceptions()
+{
+#if ENABLE_EXCEPTION_TRACKING
+  exceptionTracker.Report();
+#endif
+}
+
+void DumpPageFaultSites()
+{
+#if ENABLE_PAGE_FAULT_SAMPLING
+  memTracker.ReportPageFaults();
+#endif
+}
+
+void DumpLocality()
+{
+#if ENABLE_LOCALITY_REPORT
+  memTracker.ReportLocality();
+#endif
+}
+
+void BeginNoAllocZone()
+{
+#if ENABLE_NO_ALLOC_ZONES
+  noAllocDepth++;
+#endif
+}
+
+void EndNoAllocZone()
+{
+#if ENABLE_NO_ALLOC_ZONES
+  noAllocDepth--;
+#endif
+}
+
+unsigned long long NoAllocViolations()
+{
+#if ENABLE_NO_ALLOC_ZONES
+  return noAllocViolations.load( std::memory_order_relaxed );
+#else
+  return 0;
+#endif
+}
+
+void DumpMissingReserves()
+{
+#if ENABLE_RESERVE_DETECTOR
+  memTracker.ReportMissingReserves();
+#endif
+}
+
+void DumpDuplicateBlocks()
+{
+#if ENABLE_CONTENT_ANALYSIS
+  memTracker.ReportDuplicateBlocks();
+#endif
+}
+
+unsigned long long ThreadAllocatedBytes()
+{
+#ifdef ENABLE_ALLOCATION_COUNTERS
+  ThreadRecord* record = threadRegistry.GetCurrent();
+  return record ? record->allocatedBytes.load( std::memory_order_relaxed ) : 0;
+#else
+  return 0;
+#endif
+}
+
+unsigned long long ThreadFreedBytes()
+{
+#ifdef ENABLE_ALLOCATION_COUNTERS
+  ThreadRecord* record = threadRegistry.GetCurrent();
+  return record ? record->freedBytes.load( std::memory_order_relaxed ) : 0;
+#else
+  return 0;
+#endif
+}
+
+unsigned long long ProcessAllocatedBytes()
+{
+#ifdef ENABLE_ALLOCATION_COUNTERS
+  unsigned long long allocated, freed;
+  threadRegistry.GetProcessBytes( allocated, freed );
+  return allocated;
+#else
+  return 0;
+#endif
+}
+
+unsigned long long ProcessFreedBytes()
+{
+#ifdef ENABLE_ALLOCATION_COUNTERS
+  unsigned long long allocated, freed;
+  threadRegistry.GetProcessBytes( allocated, freed );
+  return freed;
+#else
+  return 0;
+#endif
+}
+
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Analyzer process, built from this file as a console program with
+// MEMLEAKTRACKER_ANALYZER defined.
+// Usage: MemLeakAnalyzer <program> [arguments]
+// The program is started with event rings connected (see ENABLE_EVENT_RINGS),
+// the analyzer keeps its allocation table and reports the leaks on exit.
+//
+// Queries over traces recorded with ENABLE_EVENT_TRACE, times in seconds
+// from the start of the trace:
+//   MemLeakAnalyzer -index <trace>             (re)builds <trace>.index
+//   MemLeakAnalyzer -live <trace> <time>       allocations live at a time
+//   MemLeakAnalyzer -sites <trace> <from> <to> live bytes per site over a range
+//   MemLeakAnalyzer -peak <trace>              allocations live at the peak
+//
+//   MemLeakAnalyzer -dump <file.dmp>           leaks of a crashed process
+// reads the allocation tables out of a full memory minidump of a program built
+// with ENABLE_DUMP_DESCRIPTOR.
+//
+// The index holds a checkpoint of the heap every TRACE_CHECKPOINT_INTERVAL
+// events, queries replay the trace from the closest one. It is built by the
+// first query if missing.
+
+#ifdef MEMLEAKTRACKER_ANALYZER
+
+#include <stdio.h>
+#include <intrin.h>
+#include <DbgHelp.h>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <string>
+#include <map>
+#include <queue>
+#include <functional>
+#pragma comment(lib, "Dbghelp.lib")
+
+namespace LeakTracker
+{
+
+class Analyzer
+{
+  struct Allocation
+  {
+    uint64_t size;
+    uint32_t frameCount;
+    uint64_t frames[ STACK_TRACE_DEPTH ];
+  };
+
+  HANDLE process;
+  EventSection* section;
+  std::vector<TrackerEvent> pending;
+  std::unordered_map<uint64_t, Allocation> allocations;
+  uint64_t eventCount = 0;
+  uint64_t unmatchedFrees = 0;
+
+  void ApplyEvent( const TrackerEvent& event )
+  {
+    eventCount++;
+    if ( event.type == EventType::Allocate )
+    {
+      Allocation& allocation = allocations[ event.address ];
+      allocation.size = event.size;
+      allocation.frameCount = event.frameCount;
+      memcpy( allocation.frames, event.frames, sizeof( allocation.frames ) );
+    }
+    else if ( !allocations.erase( event.address ) )
+      unmatchedFrees++;
+  }
+
+  void DumpStack( const Allocation& allocation )
+  {
+    for ( uint32_t x = 0; x < allocation.frameCount; x++ )
+    {
+      if ( !allocation.frames[ x ] )
+        continue;
+
+      DWORD displacement;
+      IMAGEHLP_LINE64 line;
+      line.SizeOfStruct = sizeof( IMAGEHLP_LINE64 );
+      if ( SymGetLineFromAddr64( process, allocation.frames[ x ], &displacement, &line ) )
+        _tprintf( _T( "\t\t%hs (%d)\n" ), line.FileName, line.LineNumber );
+      else
+        _tprintf( _T( "\t\tUnresolved address: %llx\n" ), allocation.frames[ x ] );
+    }
+    _tprintf( _T( "\n" ) );
+  }
+
+public:
+
+  Analyzer( HANDLE process, EventSection* section )
+    : process( process ), section( section )
+  {
+  }
+
+  void Drain()
+  {
+    uint32_t ringCount = std::min<uint32_t>( section->ringsInUse.load( std::memory_order_relaxed ), EVENT_RING_COUNT );
+    for ( uint32_t x = 0; x < ringCount; x++ )
+    {
+      EventRing& ring = section->rings[ x ];
+      uint64_t read = ring.readIndex.load( std::memory_order_relaxed );
+      uint64_t write = ring.writeIndex.load( std::memory_order_acquire );
+      for ( ; read != write; read++ )
+        pending.push_back( ring.events[ read % EVENT_RING_CAPACITY ] );
+      ring.readIndex.store( read, std::memory_order_release );
+    }
+  }
+
+  // Applies the pending events stamped before the cutoff in timestamp order.
+  // Later events are held back since an event from another ring stamped
+  // slightly earlier may not have been published yet.
+  void Apply( uint64_t cutoff )
+  {
+    std::stable_sort( pending.begin(), pending.end(), []( const TrackerEvent& a, const TrackerEvent& b ) { return a.timestamp < b.timestamp; } );
+    auto end = std::lower_bound( pending.begin(), pending.end(), cutoff, []( const TrackerEvent& event, uint64_t time ) { return event.timestamp < time; } );
+    for ( auto event = pending.begin(); event != end; ++event )
+      ApplyEvent( *event );
+    pending.erase( pending.begin(), end );
+  }
+
+  void AddAllocation( uint64_t address, uint64_t size, const uint64_t* frames, uint32_t frameCount )
+  {
+    Allocation& allocation = allocations[ address ];
+    allocation.size = size;
+    allocation.frameCount = std::min<uint32_t>( frameCount, STACK_TRACE_DEPTH );
+    memset( allocation.frames, 0, sizeof( allocation.frames ) );
+    memcpy( allocation.frames, frames, allocation.frameCount * sizeof( uint64_t ) );
+  }
+
+  // Without an event section the symbols are expected to be loaded by the caller
+  void Report()
+  {
+    if ( section )
+    {
+      SymInitialize( process, NULL, TRUE );
+      SymSetOptions( SYMOPT_LOAD_LINES );
+    }
+
+    if ( !allocations.empty() )
+    {
+      _tprintf( _T( "\n--- Memleaks start here ---\n\n" ) );
+
+      uint64_t totalLeaked = 0;
+      for ( auto& allocation : allocations )
+      {
+        _tprintf( _T( "Leak: %llu bytes\n" ), allocation.second.size );
+        DumpStack( allocation.second );
+        totalLeaked += allocation.second.size;
+      }
+
+      _tprintf( _T( "\tTotal bytes leaked: %llu\n\n" ), totalLeaked );
+    }
+    else
+      _tprintf( _T( "**********************************************************\n\t\t\t\t\tNo memleaks found.\n**********************************************************\n\n" ) );
+
+    if ( section )
+      _tprintf( _T( "Events: %llu, dropped: %llu, frees of unknown blocks: %llu\n" ), eventCount, section->droppedEvents.load(), unmatchedFrees );
+    SymCleanup( process );
+  }
+};
+
+struct TraceEvent
+{
+  uint64_t time;
+  uint64_t order; // block index << 32 | index in block, orders events of the same time
+  uint64_t address;
+  uint64_t size;
+  uint32_t site;
+  bool isFree;
+
+  bool operator<( const TraceEvent& other ) const
+  {
+    return time != other.time ? time < other.time : order < other.order;
+  }
+};
+
+struct TraceBlock
+{
+  uint64_t offset; // of the block's events in the trace
+  uint64_t firstTime;
+  uint64_t lastTime;
+  uint32_t byteCount;
+  uint32_t eventCount;
+  uint32_t threadId;
+};
+
+struct LiveAllocation
+{
+  uint64_t address;
+  uint64_t size;
+  uint64_t time;
+  uint32_t site;
+};
+
+struct Checkpoint
+{
+  uint64_t time; // heap state after every event up to and including this time
+  uint64_t offset; // of its live allocations in the index
+  uint64_t count;
+  uint64_t bytes;
+};
+
+static const uint32_t traceIndexMagic = 0x4954544d;
+static const uint32_t traceIndexVersion = 1;
+
+struct TraceIndexHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t traceSize; // the index is rebuilt when the trace changes
+  uint64_t firstTime;
+  uint64_t lastTime;
+  uint64_t peakTime;
+  uint64_t peakBytes;
+  uint64_t siteCount;
+  uint64_t sitesOffset;
+  uint64_t blockCount;
+  uint64_t blocksOffset;
+  uint64_t checkpointCount;
+  uint64_t checkpointsOffset;
+};
+
+class HeapState
+{
+public:
+  std::unordered_map<uint64_t, LiveAllocation> live;
+  uint64_t bytes = 0;
+  uint64_t unmatchedFrees = 0;
+
+  void Apply( const TraceEvent& event )
+  {
+    auto allocation = live.find( event.address );
+    if ( allocation != live.end() )
+    {
+      bytes -= allocation->second.size;
+      live.erase( allocation );
+    }
+    else if ( event.isFree )
+      unmatchedFrees++;
+
+    if ( !event.isFree )
+    {
+      live[ event.address ] = LiveAllocation{ event.address, event.size, event.time, event.site };
+      bytes += event.size;
+    }
+  }
+};
+
+class TraceReader
+{
+  FILE* file = nullptr;
+  std::map<std::vector<uint64_t>, uint32_t> siteIds;
+
+  static uint64_t ReadVarint( const uint8_t*& in, const uint8_t* end )
+  {
+    uint64_t value = 0;
+    for ( int shift = 0; in < end && shift < 64; shift += 7 )
+    {
+      uint8_t byte = *in++;
+      value |= (uint64_t)( byte & 0x7f ) << shift;
+      if ( !( byte & 0x80 ) )
+        break;
+    }
+    return value;
+  }
+
+public:
+  TraceFileHeader header = {};
+  uint64_t size = 0;
+  std::vector<std::vector<uint64_t>> sites;
+
+  ~TraceReader()
+  {
+    if ( file )
+      fclose( file );
+  }
+
+  bool Open( const TCHAR* path )
+  {
+    if ( _tfopen_s( &file, path, _T( "rb" ) ) || !file )
+      return false;
+
+    _fseeki64( file, 0, SEEK_END );
+    size = _ftelli64( file );
+    _fseeki64( file, 0, SEEK_SET );
+    return fread( &header, sizeof( header ), 1, file ) == 1 && header.magic == traceFileMagic && header.version == traceVersion;
+  }
+
+  uint32_t GetSite( const std::vector<uint64_t>& frames )
+  {
+    auto site = siteIds.find( frames );
+    if ( site != siteIds.end() )
+      return site->second;
+
+    siteIds[ frames ] = (uint32_t)sites.size();
+    sites.push_back( frames );
+    return (uint32_t)sites.size() - 1;
+  }
+
+  // A truncated block at the end of the trace (a crashed process) is skipped
+  std::vector<TraceBlock> ReadBlockTable()
+  {
+    std::vector<TraceBlock> blocks;
+    TraceBlockHeader blockHeader;
+    uint64_t offset = sizeof( header );
+    _fseeki64( file, offset, SEEK_SET );
+    while ( fread( &blockHeader, sizeof( blockHeader ), 1, file ) == 1 && blockHeader.magic == traceBlockMagic )
+    {
+      offset += sizeof( blockHeader );
+      if ( offset + blockHeader.byteCount > size )
+        break;
+
+      blocks.push_back( TraceBlock{ offset, blockHeader.baseTime, blockHeader.baseTime, blockHeader.byteCount, blockHeader.eventCount, blockHeader.threadId } );
+      offset += blockHeader.byteCount;
+      _fseeki64( file, offset, SEEK_SET );
+    }
+    return blocks;
+  }
+
+  void ReadBlock( const TraceBlock& block, uint32_t blockIndex, std::vector<TraceEvent>& events )
+  {
+    std::vector<uint8_t> data( block.byteCount );
+    _fseeki64( file, block.offset, SEEK_SET );
+    if ( fread( data.data(), 1, data.size(), file ) != data.size() )
+      return;
+
+    const uint8_t* in = data.data();
+    const uint8_t* end = in + data.size();
+    uint64_t time = block.firstTime;
+    uint64_t address = 0;
+    uint32_t stackTable[ traceStackSlots ] = {};
+    std::vector<uint64_t> frames;
+
+    for ( uint64_t x = 0; in < end; x++ )
+    {
+      uint64_t head = ReadVarint( in, end );
+      uint32_t kind = head & 3;
+      time += head >> 2;
+      uint64_t addressDelta = ReadVarint( in, end );
+      address ^= addressDelta << 4 | addressDelta >> 60;
+
+      TraceEvent event = { time, (uint64_t)blockIndex << 32 | x, address, 0, 0, kind == TraceEventKind::Free };
+      if ( kind != TraceEventKind::Free )
+      {
+        uint64_t sizeCode = ReadVarint( in, end );
+        event.size = GetTraceClassSize( sizeCode & 127 ) - ( sizeCode >> 7 );
+
+        if ( kind == TraceEventKind::Allocate )
+          event.site = stackTable[ ReadVarint( in, end ) % traceStackSlots ];
+        else
+        {
+          frames.resize( (size_t)std::min<uint64_t>( ReadVarint( in, end ), STACK_TRACE_DEPTH ) );
+          uint64_t previous = 0;
+          for ( auto& frame : frames )
+            previous = frame = ReadVarint( in, end ) ^ previous;
+          event.site = GetSite( frames );
+          stackTable[ TraceStackHash( frames.data(), (uint32_t)frames.size() ) % traceStackSlots ] = event.site;
+        }
+      }
+      events.push_back( event );
+    }
+  }
+};
+
+class TraceIndex
+{
+  TraceReader& trace;
+  FILE* file = nullptr;
+  TraceIndexHeader header = {};
+  std::vector<TraceBlock> blocks;
+  std::vector<Checkpoint> checkpoints;
+
+  template<typename T>
+  void Write( const T* data, size_t count )
+  {
+    fwrite( data, sizeof( T ), count, file );
+  }
+
+  template<typename T>
+  bool Read( T* data, size_t count )
+  {
+    return fread( data, sizeof( T ), count, file ) == count;
+  }
+
+  void WriteCheckpoint( const HeapState& state, uint64_t time )
+  {
+    checkpoints.push_back( Checkpoint{ time, (uint64_t)_ftelli64( file ), state.live.size(), state.bytes } );
+    for ( auto& allocation : state.live )
+      Write( &allocation.second, 1 );
+  }
+
+  // Calls fn for the events in ( from, to ] in order
+  template<typename F>
+  void Replay( uint64_t from, uint64_t to, F fn )
+  {
+    std::vector<TraceEvent> events;
+    for ( uint32_t x = 0; x < blocks.size(); x++ )
+      if ( blocks[ x ].lastTime > from && blocks[ x ].firstTime <= to )
+        trace.ReadBlock( blocks[ x ], x, events );
+
+    events.erase( std::remove_if( events.begin(), events.end(), [ & ]( const TraceEvent& event ) { return event.time <= from || event.time > to; } ), events.end() );
+    std::sort( events.begin(), events.end() );
+    for ( auto& event : events )
+      fn( event );
+  }
+
+public:
+
+  TraceIndex( TraceReader& trace )
+    : trace( trace )
+  {
+  }
+
+  ~TraceIndex()
+  {
+    if ( file )
+      fclose( file );
+  }
+
+  // Blocks of different threads overlap in time. They are visited in order of
+  // their first event and their events merged through a queue, an event is
+  // applied once no block that hasn't been read yet can hold an earlier one.
+  bool Build( const TCHAR* path )
+  {
+    if ( _tfopen_s( &file, path, _T( "w+b" ) ) || !file )
+      return false;
+
+    header = TraceIndexHeader{ traceIndexMagic, traceIndexVersion, trace.size };
+    Write( &header, 1 );
+
+    blocks = trace.ReadBlockTable();
+    std::stable_sort( blocks.begin(), blocks.end(), []( const TraceBlock& a, const TraceBlock& b ) { return a.firstTime < b.firstTime; } );
+
+    HeapState state;
+    std::priority_queue<TraceEvent, std::vector<TraceEvent>, std::function<bool( const TraceEvent&, const TraceEvent& )>> pending( []( const TraceEvent& a, const TraceEvent& b ) { return b < a; } );
+    uint64_t sinceCheckpoint = 0;
+    uint64_t lastTime = 0;
+
+    auto applyBefore = [ & ]( uint64_t time )
+    {
+      for ( ; !pending.empty() && pending.top().time < time; pending.pop() )
+      {
+        const TraceEvent& event = pending.top();
+        if ( sinceCheckpoint >= TRACE_CHECKPOINT_INTERVAL && event.time > lastTime )
+        {
+          WriteCheckpoint( state, lastTime );
+          sinceCheckpoint = 0;
+        }
+
+        state.Apply( event );
+        sinceCheckpoint++;
+        lastTime = event.time;
+        if ( !header.firstTime )
+          header.firstTime = event.time;
+        if ( state.bytes > header.peakBytes )
+        {
+          header.peakBytes = state.bytes;
+          header.peakTime = event.time;
+        }
+      }
+    };
+
+    std::vector<TraceEvent> events;
+    for ( uint32_t x = 0; x < blocks.size(); x++ )
+    {
+      applyBefore( blocks[ x ].firstTime );
+      events.clear();
+      trace.ReadBlock( blocks[ x ], x, events );
+      if ( !events.empty() )
+        blocks[ x ].lastTime = events.back().time;
+      for ( auto& event : events )
+        pending.push( event );
+    }
+    applyBefore( UINT64_MAX );
+    header.lastTime = lastTime;
+
+    header.siteCount = trace.sites.size();
+    header.sitesOffset = _ftelli64( file );
+    for ( auto& site : trace.sites )
+    {
+      uint32_t frameCount = (uint32_t)site.size();
+      Write( &frameCount, 1 );
+      Write( site.data(), frameCount );
+    }
+
+    header.blockCount = blocks.size();
+    header.blocksOffset = _ftelli64( file );
+    Write( blocks.data(), blocks.size() );
+    header.checkpointCount = checkpoints.size();
+    header.checkpointsOffset = _ftelli64( file );
+    Write( checkpoints.data(), checkpoints.size() );
+
+    _fseeki64( file, 0, SEEK_SET );
+    Write( &header, 1 );
+    fflush( file );
+
+    if ( state.unmatchedFrees )
+      _tprintf( _T( "%llu frees of unknown blocks, the trace may have been started late\n" ), state.unmatchedFrees );
+    return true;
+  }
+
+  // Fails if the index is missing or belongs to a different trace
+  bool Load( const TCHAR* path )
+  {
+    if ( _tfopen_s( &file, path, _T( "rb" ) ) || !file )
+      return false;
+    if ( !Read( &header, 1 ) || header.magic != traceIndexMagic || header.version != traceIndexVersion || header.traceSize != trace.size )
+    {
+      fclose( file );
+      file = nullptr;
+      return false;
+    }
+
+    // sites are registered in index order so the ids in the checkpoints stay valid
+    _fseeki64( file, header.sitesOffset, SEEK_SET );
+    for ( uint64_t x = 0; x < header.siteCount; x++ )
+    {
+      uint32_t frameCount = 0;
+      Read( &frameCount, 1 );
+      std::vector<uint64_t> frames( std::min<uint32_t>( frameCount, STACK_TRACE_DEPTH ) );
+      Read( frames.data(), frames.size() );
+      trace.GetSite( frames );
+    }
+
+    blocks.resize( header.blockCount );
+    _fseeki64( file, header.blocksOffset, SEEK_SET );
+    Read( blocks.data(), blocks.size() );
+    checkpoints.resize( header.checkpointCount );
+    _fseeki64( file, header.checkpointsOffset, SEEK_SET );
+    return Read( checkpoints.data(), checkpoints.size() );
+  }
+
+  const TraceIndexHeader& GetHeader() const
+  {
+    return header;
+  }
+
+  uint64_t ToTime( double seconds ) const
+  {
+    return header.firstTime + (uint64_t)( seconds * ( trace.header.ticksPerSecond ? trace.header.ticksPerSecond : 1 ) );
+  }
+
+  double ToSeconds( uint64_t time ) const
+  {
+    return ( time - header.firstTime ) / (double)( trace.header.ticksPerSecond ? trace.header.ticksPerSecond : 1 );
+  }
+
+  HeapState GetLiveAt( uint64_t time )
+  {
+    HeapState state;
+    auto checkpoint = std::upper_bound( checkpoints.begin(), checkpoints.end(), time, []( uint64_t t, const Checkpoint& c ) { return t < c.time; } );
+    uint64_t from = 0;
+    if ( checkpoint != checkpoints.begin() )
+    {
+      --checkpoint;
+      std::vector<LiveAllocation> live( (size_t)checkpoint->count );
+      _fseeki64( file, checkpoint->offset, SEEK_SET );
+      Read( live.data(), live.size() );
+      for ( auto& allocation : live )
+        state.live[ allocation.address ] = allocation;
+      state.bytes = checkpoint->bytes;
+      from = checkpoint->time;
+    }
+
+    Replay( from, time, [ & ]( const TraceEvent& event ) { state.Apply( event ); } );
+    return state;
+  }
+
+  // Live bytes per site over a range of time
+  void ReportSites( uint64_t from, uint64_t to )
+  {
+    struct SiteStats
+    {
+      int64_t liveBytes = 0;
+      uint64_t startBytes = 0;
+      uint64_t peakBytes = 0;
+      uint64_t allocations = 0;
+      uint64_t allocatedBytes = 0;
+      uint64_t freedBytes = 0;
+    };
+
+    HeapState state = GetLiveAt( from );
+    std::vector<SiteStats> stats( trace.sites.size() );
+    for ( auto& allocation : state.live )
+      stats[ allocation.second.site ].liveBytes += allocation.second.size;
+    for ( auto& site : stats )
+      site.startBytes = site.peakBytes = site.liveBytes;
+
+    Replay( from, to, [ & ]( const TraceEvent& event )
+    {
+      auto allocation = state.live.find( event.address );
+      if ( allocation != state.live.end() )
+      {
+        stats[ allocation->second.site ].liveBytes -= allocation->second.size;
+        stats[ allocation->second.site ].freedBytes += allocation->second.size;
+      }
+      state.Apply( event );
+
+      if ( !event.isFree )
+      {
+        if ( event.site >= stats.size() )
+          stats.resize( trace.sites.size() );
+        SiteStats& site = stats[ event.site ];
+        site.liveBytes += event.size;
+        site.allocations++;
+        site.allocatedBytes += event.size;
+        site.peakBytes = std::max( site.peakBytes, (uint64_t)site.liveBytes );
+      }
+    } );
+
+    std::vector<uint32_t> order;
+    for ( uint32_t x = 0; x < stats.size(); x++ )
+      if ( stats[ x ].peakBytes )
+        order.push_back( x );
+    std::sort( order.begin(), order.end(), [ & ]( uint32_t a, uint32_t b ) { return stats[ a ].peakBytes > stats[ b ].peakBytes; } );
+
+    _tprintf( _T( "Live bytes per site from %.3f s to %.3f s:\n\n" ), ToSeconds( from ), ToSeconds( to ) );
+    for ( size_t x = 0; x < order.size() && x < 20; x++ )
+    {
+      SiteStats& site = stats[ order[ x ] ];
+      _tprintf( _T( "Site %u: %llu bytes at start, %lld at end, %llu peak, %llu allocations of %llu bytes, %llu bytes freed\n" ),
+                order[ x ], site.startBytes, site.liveBytes, site.peakBytes, site.allocations, site.allocatedBytes, site.freedBytes );
+      DumpSite( order[ x ] );
+    }
+  }
+
+  void ReportLive( const HeapState& state, uint64_t time )
+  {
+    std::unordered_map<uint32_t, std::pair<uint64_t, uint64_t>> sites; // bytes, count
+    for ( auto& allocation : state.live )
+    {
+      sites[ allocation.second.site ].first += allocation.second.size;
+      sites[ allocation.second.site ].second++;
+    }
+
+    std::vector<std::pair<uint32_t, std::pair<uint64_t, uint64_t>>> order( sites.begin(), sites.end() );
+    std::sort( order.begin(), order.end(), []( const auto& a, const auto& b ) { return a.second.first > b.second.first; } );
+
+    _tprintf( _T( "Live at %.3f s: %llu bytes in %llu allocations\n\n" ), ToSeconds( time ), state.bytes, (uint64_t)state.live.size() );
+    for ( size_t x = 0; x < order.size() && x < 20; x++ )
+    {
+      _tprintf( _T( "Site %u: %llu bytes in %llu allocations\n" ), order[ x ].first, order[ x ].second.first, order[ x ].second.second );
+      DumpSite( order[ x ].first );
+    }
+  }
+
+  // The process is gone by now, frames are printed as addresses
+  void DumpSite( uint32_t site )
+  {
+    for ( uint64_t frame : trace.sites[ site ] )
+      if ( frame )
+        _tprintf( _T( "\t\t%llx\n" ), frame );
+    _tprintf( _T( "\n" ) );
+  }
+};
+
+// Reads the memory of a crashed process from a minidump
+class DumpReader
+{
+  struct Range
+  {
+    uint64_t address;
+    uint64_t size;
+    uint64_t offset; // in the file
+  };
+
+  FILE* file = nullptr;
+  std::vector<Range> ranges; // sorted by address
+
+  bool ReadFile( uint64_t offset, void* data, size_t size )
+  {
+    return !_fseeki64( file, offset, SEEK_SET ) && fread( data, 1, size, file ) == size;
+  }
+
+  void ReadStreams()
+  {
+    MINIDUMP_HEADER header;
+    if ( !ReadFile( 0, &header, sizeof( header ) ) || header.Signature != MINIDUMP_SIGNATURE )
+      return;
+
+    std::vector<MINIDUMP_DIRECTORY> directory( header.NumberOfStreams );
+    if ( !ReadFile( header.StreamDirectoryRva, directory.data(), directory.size() * sizeof( MINIDUMP_DIRECTORY ) ) )
+      return;
+
+    for ( auto& stream : directory )
+    {
+      if ( stream.StreamType == Memory64ListStream )
+      {
+        MINIDUMP_MEMORY64_LIST list;
+        ReadFile( stream.Location.Rva, &list, sizeof( list ) - sizeof( list.MemoryRanges ) );
+        std::vector<MINIDUMP_MEMORY_DESCRIPTOR64> descriptors( (size_t)list.NumberOfMemoryRanges );
+        ReadFile( stream.Location.Rva + sizeof( list ) - sizeof( list.MemoryRanges ), descriptors.data(), descriptors.size() * sizeof( MINIDUMP_MEMORY_DESCRIPTOR64 ) );
+
+        // the ranges' data is stored back to back from BaseRva
+        uint64_t offset = list.BaseRva;
+        for ( auto& descriptor : descriptors )
+        {
+          ranges.push_back( Range{ descriptor.StartOfMemoryRange, descriptor.DataSize, offset } );
+          offset += descriptor.DataSize;
+        }
+      }
+      else if ( stream.StreamType == MemoryListStream )
+      {
+        ULONG32 count = 0;
+        ReadFile( stream.Location.Rva, &count, sizeof( count ) );
+        std::vector<MINIDUMP_MEMORY_DESCRIPTOR> descriptors( count );
+        ReadFile( stream.Location.Rva + sizeof( count ), descriptors.data(), descriptors.size() * sizeof( MINIDUMP_MEMORY_DESCRIPTOR ) );
+        for ( auto& descriptor : descriptors )
+          ranges.push_back( Range{ descriptor.StartOfMemoryRange, descriptor.Memory.DataSize, descriptor.Memory.Rva } );
+      }
+      else if ( stream.StreamType == ModuleListStream )
+      {
+        ULONG32 count = 0;
+        ReadFile( stream.Location.Rva, &count, sizeof( count ) );
+        std::vector<MINIDUMP_MODULE> list( count );
+        ReadFile( stream.Location.Rva + sizeof( count ), list.data(), list.size() * sizeof( MINIDUMP_MODULE ) );
+        for ( auto& module : list )
+        {
+          ULONG32 length = 0;
+          ReadFile( module.ModuleNameRva, &length, sizeof( length ) );
+          std::vector<uint16_t> name( length / 2 );
+          ReadFile( module.ModuleNameRva + sizeof( length ), name.data(), name.size() * 2 );
+          modules.push_back( Module{ module.BaseOfImage, module.SizeOfImage, std::wstring( name.begin(), name.end() ) } );
+        }
+      }
+    }
+
+    std::sort( ranges.begin(), ranges.end(), []( const Range& a, const Range& b ) { return a.address < b.address; } );
+  }
+
+public:
+  struct Module
+  {
+    uint64_t base;
+    uint32_t size;
+    std::wstring name;
+  };
+
+  std::vector<Module> modules;
+
+  ~DumpReader()
+  {
+    if ( file )
+      fclose( file );
+  }
+
+  // Fails if the file isn't a minidump or holds no memory
+  bool Open( const TCHAR* path )
+  {
+    if ( _tfopen_s( &file, path, _T( "rb" ) ) || !file )
+      return false;
+    ReadStreams();
+    return !ranges.empty();
+  }
+
+  bool Read( uint64_t address, void* data, size_t size )
+  {
+    unsigned char* out = (unsigned char*)data;
+    while ( size )
+    {
+      auto range = std::upper_bound( ranges.begin(), ranges.end(), address, []( uint64_t a, const Range& r ) { return a < r.address; } );
+      if ( range == ranges.begin() || address - ( --range )->address >= range->size )
+        return false;
+
+      size_t chunk = (size_t)std::min<uint64_t>( size, range->address + range->size - address );
+      if ( !ReadFile( range->offset + address - range->address, out, chunk ) )
+        return false;
+      out += chunk;
+      address += chunk;
+      size -= chunk;
+    }
+    return true;
+  }
+
+  uint64_t ReadPointer( uint64_t address, uint32_t pointerSize )
+  {
+    uint64_t value = 0;
+    return Read( address, &value, pointerSize ) ? value : 0;
+  }
+
+  // Returns 0 if the dump holds no descriptor
+  uint64_t FindDescriptor( DumpDescriptor& descriptor )
+  {
+    std::vector<uint64_t> data;
+    for ( auto& range : ranges )
+    {
+      for ( uint64_t offset = 0; offset + sizeof( descriptor ) <= range.size; offset += data.size() * 8 - sizeof( descriptor ) )
+      {
+        data.resize( (size_t)std::min<uint64_t>( range.size - offset, 1 << 20 ) / 8 );
+        if ( !ReadFile( range.offset + offset, data.data(), data.size() * 8 ) )
+          break;
+
+        for ( size_t x = 0; x + sizeof( descriptor ) / 8 <= data.size(); x++ )
+        {
+          if ( data[ x ] != dumpDescriptorMagic[ 0 ] || data[ x + 1 ] != dumpDescriptorMagic[ 1 ] || data[ x + 2 ] != range.address + offset + x * 8 )
+            continue;
+          memcpy( &descriptor, &data[ x ], sizeof( descriptor ) );
+          return data[ x + 2 ];
+        }
+
+        if ( offset + data.size() * 8 >= range.size )
+          break;
+      }
+    }
+    return 0;
+  }
+};
+
+// Decodes the tracker's allocation tables with the layout of a descriptor
+class DumpTableReader
+{
+  DumpReader& dump;
+  const DumpDescriptor& layout;
+  std::unordered_map<uint32_t, std::vector<uint64_t>> depotStacks;
+
+  uint64_t ReadPointer( uint64_t address )
+  {
+    return dump.ReadPointer( address, layout.pointerSize );
+  }
+
+  const std::vector<uint64_t>& GetDepotStack( uint32_t id )
+  {
+    auto cached = depotStacks.find( id );
+    if ( cached != depotStacks.end() )
+      return cached->second;
+
+    std::vector<uint64_t>& frames = depotStacks[ id ];
+    uint64_t chunk = ReadPointer( layout.stackDepot + layout.depotChunksOffset + (uint64_t)( id / layout.depotStacksPerChunk ) * layout.depotChunkSize );
+    std::vector<unsigned char> stack( layout.depotStackSize );
+    if ( !chunk || !dump.Read( chunk + (uint64_t)( id % layout.depotStacksPerChunk ) * layout.depotStackSize, stack.data(), stack.size() ) )
+      return frames;
+
+    for ( uint32_t x = 0; x < layout.stackDepth; x++ )
+    {
+      uint16_t module;
+      uint32_t offset;
+      memcpy( &module, &stack[ layout.depotStackModulesOffset + x * 2 ], 2 );
+      memcpy( &offset, &stack[ layout.depotStackOffsetsOffset + x * 4 ], 4 );
+      frames.push_back( module == 0xffff ? 0 : ReadPointer( layout.stackDepot + layout.depotModulesOffset + (uint64_t)module * layout.depotModuleSize ) + offset );
+    }
+    return frames;
+  }
+
+  void ReadEntry( const unsigned char* entry, Analyzer& analyzer )
+  {
+    uint64_t address = 0;
+    uint64_t size = 0;
+    std::vector<uint64_t> frames;
+
+    if ( layout.flags & dumpCompactEntries )
+    {
+      uint16_t sizeCode;
+      memcpy( &address, entry + layout.keyOffset, 6 );
+      memcpy( &sizeCode, entry + layout.sizeOffset, 2 );
+      size = DecodeSize( sizeCode );
+      if ( layout.flags & dumpStackTraces )
+      {
+        uint32_t id;
+        memcpy( &id, entry + layout.stackOffset, 4 );
+        frames = GetDepotStack( id );
+      }
+    }
+    else
+    {
+      memcpy( &address, entry + layout.keyOffset, layout.pointerSize );
+      memcpy( &size, entry + layout.sizeOffset, layout.pointerSize );
+      for ( uint32_t x = 0; ( layout.flags & dumpStackTraces ) && x < layout.stackDepth; x++ )
+      {
+        uint64_t frame = 0;
+        memcpy( &frame, entry + layout.stackOffset + x * layout.pointerSize, layout.pointerSize );
+        frames.push_back( frame );
+      }
+    }
+
+    analyzer.AddAllocation( address, size, frames.data(), (uint32_t)frames.size() );
+  }
+
+public:
+  uint64_t unreadableEntries = 0;
+
+  DumpTableReader( DumpReader& dump, const DumpDescriptor& layout )
+    : dump( dump ), layout( layout )
+  {
+  }
+
+  // Reads both storages of a table, a grow may have been in progress
+  void ReadTable( uint64_t table, Analyzer& analyzer )
+  {
+    static const size_t batchSize = 65536;
+    std::vector<signed char> control;
+    std::vector<unsigned char> entries;
+
+    for ( uint32_t storage : layout.storageOffsets )
+    {
+      uint64_t controlAddress = ReadPointer( table + storage + layout.controlOffset );
+      uint64_t entriesAddress = ReadPointer( table + storage + layout.entriesOffset );
+      uint64_t capacity = ReadPointer( table + storage + layout.capacityOffset );
+      for ( uint64_t first = 0; first < capacity; first += batchSize )
+      {
+        size_t count = (size_t)std::min<uint64_t>( batchSize, capacity - first );
+        control.resize( count );
+        entries.resize( count * layout.entrySize );
+        if ( !dump.Read( controlAddress + first, control.data(), count ) || !dump.Read( entriesAddress + first * layout.entrySize, entries.data(), entries.size() ) )
+        {
+          unreadableEntries += count;
+          continue;
+        }
+
+        for ( size_t x = 0; x < count; x++ )
+          if ( control[ x ] >= 0 )
+            ReadEntry( &entries[ x * layout.entrySize ], analyzer );
+      }
+    }
+  }
+
+  void ReadTables( Analyzer& analyzer )
+  {
+    if ( !( layout.flags & dumpPerThreadTables ) )
+    {
+      ReadTable( layout.table, analyzer );
+      return;
+    }
+
+    // records are never freed, the limit only guards against a damaged list
+    uint64_t record = ReadPointer( layout.threadRecords );
+    for ( uint32_t x = 0; record && x < 1000000; x++ )
+    {
+      uint64_t owned = ReadPointer( record + layout.recordTableOffset );
+      if ( owned )
+        ReadTable( owned + layout.ownedTableOffset, analyzer );
+      record = ReadPointer( record + layout.recordNextOffset );
+    }
+  }
+};
+
+int RunDumpReport( const TCHAR* path )
+{
+  DumpReader dump;
+  if ( !dump.Open( path ) )
+  {
+    _tprintf( _T( "Failed to read minidump %s\n" ), path );
+    return 1;
+  }
+
+  DumpDescriptor layout;
+  if ( !dump.FindDescriptor( layout ) )
+  {
+    _tprintf( _T( "No tracker found in %s, it needs full memory and a program built with ENABLE_DUMP_DESCRIPTOR\n" ), path );
+    return 1;
+  }
+  if ( layout.version != dumpDescriptorVersion || layout.pointerSize > sizeof( uint64_t ) )
+  {
+    _tprintf( _T( "Unsupported tracker layout version %u\n" ), layout.version );
+    return 1;
+  }
+
+  // symbols are loaded for the modules listed in the dump, the process is gone
+  HANDLE symbols = (HANDLE)&dump;
+  SymInitialize( symbols, NULL, FALSE );
+  SymSetOptions( SYMOPT_LOAD_LINES );
+  for ( auto& module : dump.modules )
+    SymLoadModuleExW( symbols, NULL, module.name.c_str(), NULL, module.base, module.size, NULL, 0 );
+
+  Analyzer analyzer( symbols, nullptr );
+  DumpTableReader tables( dump, layout );
+  tables.ReadTables( analyzer );
+  analyzer.Report();
+  if ( tables.unreadableEntries )
+    _tprintf( _T( "%llu table slots were missing from the dump\n" ), tables.unreadableEntries );
+  return 0;
 }
 
-void __cdecl operator delete( void* pointer, const char* file, int line )
+int RunTraceQuery( int argc, TCHAR* argv[] )
 {
-  LeakTracker::memTracker.RemovePointer( pointer );
-  free( pointer );
+  std::basic_string<TCHAR> command = argv[ 1 ];
+  std::basic_string<TCHAR> indexPath = std::basic_string<TCHAR>( argv[ 2 ] ) + _T( ".index" );
+
+  TraceReader trace;
+  if ( !trace.Open( argv[ 2 ] ) )
+  {
+    _tprintf( _T( "Failed to open trace %s\n" ), argv[ 2 ] );
+    return 1;
+  }
+
+  TraceIndex index( trace );
+  if ( command == _T( "-index" ) || !index.Load( indexPath.c_str() ) )
+  {
+    _tprintf( _T( "Indexing %s\n" ), argv[ 2 ] );
+    if ( !index.Build( indexPath.c_str() ) )
+    {
+      _tprintf( _T( "Failed to write index %s\n" ), indexPath.c_str() );
+      return 1;
+    }
+  }
+
+  const TraceIndexHeader& header = index.GetHeader();
+  if ( command == _T( "-index" ) )
+    _tprintf( _T( "%.3f s of trace, %llu sites, peak of %llu bytes at %.3f s\n" ), index.ToSeconds( header.lastTime ), header.siteCount, header.peakBytes, index.ToSeconds( header.peakTime ) );
+  else if ( command == _T( "-live" ) && argc >= 4 )
+  {
+    uint64_t time = index.ToTime( _tstof( argv[ 3 ] ) );
+    index.ReportLive( index.GetLiveAt( time ), time );
+  }
+  else if ( command == _T( "-sites" ) && argc >= 5 )
+    index.ReportSites( index.ToTime( _tstof( argv[ 3 ] ) ), index.ToTime( _tstof( argv[ 4 ] ) ) );
+  else if ( command == _T( "-peak" ) )
+    index.ReportLive( index.GetLiveAt( header.peakTime ), header.peakTime );
+  else
+  {
+    _tprintf( _T( "Unknown query %s\n" ), argv[ 1 ] );
+    return 1;
+  }
+  return 0;
+}
 }
 
-void __cdecl operator delete[]( void* pointer, const char* file, int line )
+int _tmain( int argc, TCHAR* argv[] )
 {
-  LeakTracker::memTracker.RemovePointer( pointer );
-  free( pointer );
+  using namespace LeakTracker;
+
+  if ( argc < 2 )
+  {
+    _tprintf( _T( "Usage: %s <program> [arguments]\n" ), argv[ 0 ] );
+    _tprintf( _T( "       %s -index|-peak <trace>\n" ), argv[ 0 ] );
+    _tprintf( _T( "       %s -live <trace> <seconds>\n" ), argv[ 0 ] );
+    _tprintf( _T( "       %s -sites <trace> <from seconds> <to seconds>\n" ), argv[ 0 ] );
+    _tprintf( _T( "       %s -dump <minidump>\n" ), argv[ 0 ] );
+    return 1;
+  }
+
+  if ( !_tcscmp( argv[ 1 ], _T( "-dump" ) ) && argc >= 3 )
+    return RunDumpReport( argv[ 2 ] );
+  if ( argv[ 1 ][ 0 ] == '-' && argc >= 3 )
+    return RunTraceQuery( argc, argv );
+
+  std::basic_string<TCHAR> commandLine;
+  for ( int x = 1; x < argc; x++ )
+  {
+    commandLine += x > 1 ? _T( " \"" ) : _T( "\"" );
+    commandLine += argv[ x ];
+    commandLine += _T( "\"" );
+  }
+
+  STARTUPINFO startupInfo = { sizeof( startupInfo ) };
+  PROCESS_INFORMATION processInfo;
+  if ( !CreateProcess( NULL, &commandLine[ 0 ], NULL, NULL, FALSE, CREATE_SUSPENDED, NULL, NULL, &startupInfo, &processInfo ) )
+  {
+    _tprintf( _T( "Failed to start %s\n" ), argv[ 1 ] );
+    return 1;
+  }
+
+  // the section has to exist before the tracker in the program starts up
+  TCHAR name[ 64 ];
+  GetEventSectionName( name, processInfo.dwProcessId );
+  HANDLE mapping = CreateFileMapping( INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)( (uint64_t)sizeof( EventSection ) >> 32 ), (DWORD)sizeof( EventSection ), name );
+  EventSection* section = mapping ? (EventSection*)MapViewOfFile( mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof( EventSection ) ) : nullptr;
+  if ( !section )
+  {
+    _tprintf( _T( "Failed to create the event section\n" ) );
+    TerminateProcess( processInfo.hProcess, 1 );
+    return 1;
+  }
+
+  section->magic = eventSectionMagic;
+  section->version = eventSectionVersion;
+  section->ringCount = EVENT_RING_COUNT;
+  section->ringCapacity = EVENT_RING_CAPACITY;
+  section->stackDepth = STACK_TRACE_DEPTH;
+  section->analyzerProcessId = GetCurrentProcessId();
+  ResumeThread( processInfo.hThread );
+
+  Analyzer analyzer( processInfo.hProcess, section );
+  uint64_t cutoff = 0;
+  bool exiting = false;
+  for ( ;; )
+  {
+    exiting = section->state.load( std::memory_order_acquire ) == SessionState::Exiting;
+    bool exited = WaitForSingleObject( processInfo.hProcess, 1 ) != WAIT_TIMEOUT;
+
+    uint64_t pollStart = __rdtsc();
+    analyzer.Drain();
+    if ( exiting || exited )
+      break;
+    analyzer.Apply( cutoff );
+    cutoff = pollStart;
+  }
+
+  analyzer.Apply( UINT64_MAX );
+
+  // a program without the tracker's event rings neither takes a ring nor announces its exit
+  bool connected = exiting || section->ringsInUse.load( std::memory_order_relaxed );
+  if ( connected )
+    analyzer.Report();
+  else
+    _tprintf( _T( "No tracker connected (built without ENABLE_EVENT_RINGS?)\n" ) );
+  section->state.store( SessionState::Reported, std::memory_order_release );
+
+  DWORD exitCode = 0;
+  WaitForSingleObject( processInfo.hProcess, INFINITE );
+  GetExitCodeProcess( processInfo.hProcess, &exitCode );
+  UnmapViewOfFile( section );
+  CloseHandle( mapping );
+  CloseHandle( processInfo.hThread );
+  CloseHandle( processInfo.hProcess );
+  return connected ? (int)exitCode : 1;
 }
 
-#endif // ENABLE_MEMORY_LEAK_TRACKING
\ No newline at end of file
+#endif // MEMLEAKTRACKER_ANALYZER
\ No newline at end of file
@@ -0,0 +1,140 @@
+/*
+Copyright (c) 2021 Barna 'BoyC' Buza - https://github.com/BoyC/MemLeakTracker
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of 
+this software and associated documentation files (the "Software"), to deal in 
+the Software without restriction, including without limitation the rights to 
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+of the Software, and to permit persons to whom the Software is furnished to do 
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all 
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+SOFTWARE.
+*/
+
+/*
+
+Optional runtime interface of MemLeakTracker.cpp. The CPP works without this
+header; include it only where the application wants to talk to the tracker.
+
+Every function here is defined in all configurations and does nothing when
+tracking or the related feature is disabled in the config section of the CPP.
+
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <intrin.h>
+
+namespace LeakTracker
+{
+
+// Prints p50/p99/p99.9/max of the cycles spent in the tracked new/delete,
+// split by phase, to the debug output (ENABLE_LATENCY_HISTOGRAMS)
+void DumpLatencyHistograms();
+
+// Prints the live bytes per module to the debug output. An allocation belongs
+// to the first module in its stack outside of the Windows directory.
+// (ENABLE_MODULE_ATTRIBUTION)
+void DumpLiveBytesPerModule();
+
+// Ends the startup phase and prints the allocations made during static
+// initialization and startup per call site to the debug output. Later calls
+// do nothing. (ENABLE_STARTUP_PHASES)
+void MarkReady();
+
+// Ends the current epoch (a frame, a batch, an event loop tick) and starts the
+// next one. DumpEpochProfile() prints the distribution of allocations, bytes
+// and frees per epoch and the epochs with the most allocations, with their top
+// call sites, to the debug output. (ENABLE_EPOCH_PROFILE)
+void MarkEpoch();
+void DumpEpochProfile();
+
+// Coroutine frames are allocated through the promise type's operator new when
+// it has one. Frames allocated through AllocateCoroutineFrame() and released
+// through FreeCoroutineFrame(), for example by deriving the promise type from
+// CoroutineFramePromise, are counted per coroutine and DumpCoroutineFrames()
+// prints their counts, bytes and peak live bytes to the debug output. The
+// coroutine is any address inside it, like the return address of an operator
+// new that isn't inlined. (ENABLE_COROUTINE_ATTRIBUTION)
+void* AllocateCoroutineFrame( size_t size, const void* coroutine );
+void FreeCoroutineFrame( void* p );
+void DumpCoroutineFrames();
+
+struct CoroutineFramePromise
+{
+  __declspec( noinline ) static void* operator new( size_t size )
+  {
+    return AllocateCoroutineFrame( size, _ReturnAddress() );
+  }
+  static void operator delete( void* p )
+  {
+    FreeCoroutineFrame( p );
+  }
+};
+
+// Prints the C++ throws per exception type and per throw site, with the bytes
+// of the thrown objects, to the debug output (ENABLE_EXCEPTION_TRACKING)
+void DumpExceptions();
+
+// Prints the call sites whose fresh blocks have the most pages outside of the
+// working set, each a page fault on first touch, estimated from sampled
+// allocations, to the debug output (ENABLE_PAGE_FAULT_SAMPLING)
+void DumpPageFaultSites();
+
+// Prints the call sites whose live objects are the most scattered, with the
+// pages and cache lines they touch per 1000 objects against packed placement
+// and the geometric mean distance between consecutive allocations, to the
+// debug output (ENABLE_LOCALITY_REPORT)
+void DumpLocality();
+
+// No-allocation zones: new or delete on the calling thread between
+// BeginNoAllocZone() and EndNoAllocZone() is counted and, depending on
+// NO_ALLOC_POLICY, reported with its stack or aborted. Zones nest.
+// (ENABLE_NO_ALLOC_ZONES)
+void BeginNoAllocZone();
+void EndNoAllocZone();
+unsigned long long NoAllocViolations();
+
+class ScopedNoAlloc
+{
+public:
+  ScopedNoAlloc()
+  {
+    BeginNoAllocZone();
+  }
+  ~ScopedNoAlloc()
+  {
+    EndNoAllocZone();
+  }
+  ScopedNoAlloc( const ScopedNoAlloc& ) = delete;
+  ScopedNoAlloc& operator=( const ScopedNoAlloc& ) = delete;
+};
+
+// Prints the call sites where a container keeps growing by reallocation,
+// with the bytes copied, to the debug output (ENABLE_RESERVE_DETECTOR)
+void DumpMissingReserves();
+
+// Hashes the contents of all live blocks and prints the call sites with the
+// most bytes in duplicate or all-zero blocks to the debug output. Blocks freed
+// during the pass are held until hashing finishes. (ENABLE_CONTENT_ANALYSIS)
+void DumpDuplicateBlocks();
+
+// Bytes allocated and freed through new/delete by the calling thread and by
+// the whole process. Frees are attributed to the thread that issues them.
+// (ENABLE_ALLOCATION_COUNTERS_IN_DEBUG/RELEASE, zero otherwise)
+unsigned long long ThreadAllocatedBytes();
+unsigned long long ThreadFreedBytes();
+unsigned long long ProcessAllocatedBytes();
+unsigned long long ProcessFreedBytes();
+
+}
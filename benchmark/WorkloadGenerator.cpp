@@ -0,0 +1,374 @@
+/*
+Copyright (c) 2021 Barna 'BoyC' Buza - https://github.com/BoyC/MemLeakTracker
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+
+Synthetic allocation workload for benchmarking the tracker. Build it as a
+console program together with MemLeakTracker.cpp, in whichever configuration
+is to be measured.
+
+Every thread runs the same number of operations. An operation allocates a
+block through operator new with a size and a lifetime drawn from the chosen
+distributions, at a random call stack depth, and frees the blocks whose
+lifetime (counted in operations) has run out. Some of the frees can be handed
+to other threads. Runs are reproducible: every thread draws from its own
+generator seeded from -seed.
+
+Usage: WorkloadGenerator [options]
+  -threads <n>                 worker threads (4)
+  -ops <n>                     operations per thread (1000000)
+  -size fixed:<bytes>          block sizes (fixed:64)
+        lognormal:<median>:<sigma>
+        bimodal:<small>:<large>:<large fraction>
+  -lifetime fixed:<ops>        block lifetimes in operations (exponential:1000)
+            exponential:<mean ops>
+            forever            blocks are only freed after the run
+  -cross <fraction>            frees handed to another thread (0)
+  -depth <min>:<max>           call stack depth of the allocations (0:0)
+  -seed <n>                    (1)
+
+Examples:
+  100M live entries:           -threads 8 -ops 12500000 -size fixed:16 -lifetime forever
+  cross thread frees:          -threads 64 -cross 0.5 -lifetime exponential:256
+
+*/
+
+#include "../MemLeakTracker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Distribution
+{
+  enum class Type { Fixed, LogNormal, Bimodal, Exponential, Forever } type = Type::Fixed;
+  double a = 0;
+  double b = 0;
+  double c = 0;
+};
+
+struct Config
+{
+  int threads = 4;
+  uint64_t ops = 1000000;
+  Distribution size = { Distribution::Type::Fixed, 64 };
+  Distribution lifetime = { Distribution::Type::Exponential, 1000 };
+  double crossFraction = 0;
+  int minDepth = 0;
+  int maxDepth = 0;
+  uint64_t seed = 1;
+};
+
+// splitmix64, the results don't depend on the standard library
+class Random
+{
+  uint64_t state;
+
+public:
+
+  Random( uint64_t seed )
+    : state( seed )
+  {
+  }
+
+  uint64_t Next()
+  {
+    uint64_t z = ( state += 0x9e3779b97f4a7c15ull );
+    z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+    z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebull;
+    return z ^ ( z >> 31 );
+  }
+
+  // ( 0, 1 ]
+  double Uniform()
+  {
+    return ( ( Next() >> 11 ) + 1 ) * ( 1.0 / 9007199254740992.0 );
+  }
+
+  double Normal()
+  {
+    return sqrt( -2.0 * log( Uniform() ) ) * cos( 6.283185307179586 * Uniform() );
+  }
+
+  uint64_t Below( uint64_t limit )
+  {
+    return limit ? Next() % limit : 0;
+  }
+};
+
+static const uint64_t forever = UINT64_MAX;
+
+uint64_t Draw( const Distribution& distribution, Random& random )
+{
+  switch ( distribution.type )
+  {
+  case Distribution::Type::Fixed:
+    return (uint64_t)distribution.a;
+  case Distribution::Type::LogNormal:
+    return (uint64_t)std::max( 1.0, distribution.a * exp( distribution.b * random.Normal() ) );
+  case Distribution::Type::Bimodal:
+    return (uint64_t)( random.Uniform() <= distribution.c ? distribution.b : distribution.a );
+  case Distribution::Type::Exponential:
+    return (uint64_t)( -log( random.Uniform() ) * distribution.a );
+  default:
+    return forever;
+  }
+}
+
+bool ParseDistribution( const char* text, Distribution& distribution )
+{
+  double values[ 3 ] = {};
+  const char* arguments = strchr( text, ':' );
+  for ( int x = 0; arguments && x < 3; x++ )
+  {
+    values[ x ] = atof( arguments + 1 );
+    arguments = strchr( arguments + 1, ':' );
+  }
+
+  static const struct { const char* name; Distribution::Type type; } names[] =
+  {
+    { "fixed", Distribution::Type::Fixed },
+    { "lognormal", Distribution::Type::LogNormal },
+    { "bimodal", Distribution::Type::Bimodal },
+    { "exponential", Distribution::Type::Exponential },
+    { "forever", Distribution::Type::Forever },
+  };
+
+  for ( auto& name : names )
+  {
+    if ( strncmp( text, name.name, strlen( name.name ) ) )
+      continue;
+    distribution = Distribution{ name.type, values[ 0 ], values[ 1 ], values[ 2 ] };
+    return true;
+  }
+  return false;
+}
+
+bool ParseArguments( int argc, char* argv[], Config& config )
+{
+  for ( int x = 1; x + 1 < argc; x += 2 )
+  {
+    const char* option = argv[ x ];
+    const char* value = argv[ x + 1 ];
+    if ( !strcmp( option, "-threads" ) )
+      config.threads = std::max( 1, atoi( value ) );
+    else if ( !strcmp( option, "-ops" ) )
+      config.ops = strtoull( value, nullptr, 10 );
+    else if ( !strcmp( option, "-size" ) )
+    {
+      if ( !ParseDistribution( value, config.size ) )
+        return false;
+    }
+    else if ( !strcmp( option, "-lifetime" ) )
+    {
+      if ( !ParseDistribution( value, config.lifetime ) )
+        return false;
+    }
+    else if ( !strcmp( option, "-cross" ) )
+      config.crossFraction = atof( value );
+    else if ( !strcmp( option, "-depth" ) )
+    {
+      config.minDepth = config.maxDepth = atoi( value );
+      if ( const char* max = strchr( value, ':' ) )
+        config.maxDepth = std::max( config.minDepth, atoi( max + 1 ) );
+    }
+    else if ( !strcmp( option, "-seed" ) )
+      config.seed = strtoull( value, nullptr, 10 );
+    else
+      return false;
+  }
+  return argc % 2 == 1;
+}
+
+// Each level is a separate frame so blocks allocated at different depths have different stacks
+#ifdef _MSC_VER
+__declspec( noinline )
+#else
+__attribute__( ( noinline ) )
+#endif
+void* AllocateAtDepth( size_t size, int depth )
+{
+  static std::atomic<int> sink;
+  if ( !depth )
+    return operator new( size );
+
+  void* p = AllocateAtDepth( size, depth - 1 );
+  sink.fetch_add( 1, std::memory_order_relaxed ); // no tail call
+  return p;
+}
+
+struct PendingFree
+{
+  uint64_t due; // operation index
+  void* p;
+
+  bool operator<( const PendingFree& other ) const
+  {
+    return due > other.due;
+  }
+};
+
+// Blocks other threads handed over to be freed
+struct Inbox
+{
+  std::mutex lock;
+  std::vector<void*> blocks;
+};
+
+class Workload
+{
+  const Config& config;
+  std::vector<Inbox> inboxes;
+  std::atomic<int> running;
+  std::atomic<uint64_t> liveBlocks{ 0 };
+  std::atomic<uint64_t> remoteFrees{ 0 };
+
+  void DrainInbox( int thread, std::vector<void*>& scratch )
+  {
+    {
+      std::lock_guard<std::mutex> guard( inboxes[ thread ].lock );
+      scratch.swap( inboxes[ thread ].blocks );
+    }
+    for ( void* p : scratch )
+      operator delete( p );
+    remoteFrees.fetch_add( scratch.size(), std::memory_order_relaxed );
+    scratch.clear();
+  }
+
+  void Free( int thread, void* p, Random& random )
+  {
+    if ( config.threads > 1 && config.crossFraction > 0 && random.Uniform() <= config.crossFraction )
+    {
+      int target = (int)( ( thread + 1 + random.Below( config.threads - 1 ) ) % config.threads );
+      std::lock_guard<std::mutex> guard( inboxes[ target ].lock );
+      inboxes[ target ].blocks.push_back( p );
+    }
+    else
+      operator delete( p );
+  }
+
+  void Run( int thread, std::vector<void*>& kept )
+  {
+    Random random( config.seed * 0x100000001b3ull + thread );
+    std::vector<PendingFree> pending;
+    std::vector<void*> scratch;
+    uint64_t frees = 0;
+
+    for ( uint64_t op = 0; op < config.ops; op++ )
+    {
+      size_t size = (size_t)Draw( config.size, random );
+      uint64_t lifetime = Draw( config.lifetime, random );
+      int depth = config.minDepth + (int)random.Below( config.maxDepth - config.minDepth + 1 );
+
+      char* p = (char*)AllocateAtDepth( size, depth );
+      if ( size )
+        *p = (char)op;
+
+      if ( lifetime == forever )
+        kept.push_back( p );
+      else
+      {
+        pending.push_back( PendingFree{ op + lifetime, p } );
+        std::push_heap( pending.begin(), pending.end() );
+      }
+
+      while ( !pending.empty() && pending.front().due <= op )
+      {
+        std::pop_heap( pending.begin(), pending.end() );
+        Free( thread, pending.back().p, random );
+        pending.pop_back();
+        frees++;
+      }
+
+      if ( !( op & 63 ) )
+        DrainInbox( thread, scratch );
+    }
+
+    liveBlocks.fetch_add( config.ops - frees, std::memory_order_relaxed );
+    for ( auto& block : pending )
+      Free( thread, block.p, random );
+
+    // keep taking handed over blocks until every thread is done handing them out
+    running.fetch_sub( 1 );
+    while ( running.load() )
+    {
+      DrainInbox( thread, scratch );
+      std::this_thread::yield();
+    }
+    DrainInbox( thread, scratch );
+  }
+
+public:
+
+  Workload( const Config& config )
+    : config( config )
+    , inboxes( config.threads )
+    , running( config.threads )
+  {
+  }
+
+  void Execute()
+  {
+    std::vector<std::vector<void*>> kept( config.threads );
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for ( int x = 0; x < config.threads; x++ )
+      threads.emplace_back( [ this, x, &kept ]() { Run( x, kept[ x ] ); } );
+    for ( auto& thread : threads )
+      thread.join();
+    double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+    uint64_t totalOps = config.ops * config.threads;
+    printf( "%d threads, %llu operations each, seed %llu\n", config.threads, (unsigned long long)config.ops, (unsigned long long)config.seed );
+    printf( "%.3f s, %.2f M operations/s\n", seconds, totalOps / seconds / 1e6 );
+    printf( "%llu blocks live at the end of the run, %llu frees by other threads\n", (unsigned long long)liveBlocks.load(), (unsigned long long)remoteFrees.load() );
+    printf( "%llu bytes allocated, %llu freed\n", LeakTracker::ProcessAllocatedBytes(), LeakTracker::ProcessFreedBytes() );
+
+    LeakTracker::DumpLatencyHistograms();
+
+    for ( auto& blocks : kept )
+      for ( void* p : blocks )
+        operator delete( p );
+  }
+};
+
+int main( int argc, char* argv[] )
+{
+  Config config;
+  if ( !ParseArguments( argc, argv, config ) )
+  {
+    printf( "Invalid arguments, see the top of WorkloadGenerator.cpp for the options\n" );
+    return 1;
+  }
+
+  Workload workload( config );
+  workload.Execute();
+  return 0;
+}
\ No newline at end of file